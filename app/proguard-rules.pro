@@ -18,4 +18,19 @@
 
 # If you keep the line number information, uncomment this to
 # hide the original source file name.
-#-renamesourcefileattribute SourceFile
\ No newline at end of file
+#-renamesourcefileattribute SourceFile
+# Read field by field from native code (toCompressOptions() in native-lib.cpp)
+-keepclassmembers class com.deepion.kittypress.CompressionOptions {
+    <fields>;
+}
+
+# Called by name from native code (documentOpener() in native-lib.cpp)
+-keep interface com.deepion.kittypress.KittyPressNative$InputSource {
+    int openInput(java.lang.String);
+}
+
+# Called by name from native code (decompressToTreeNative() in native-lib.cpp)
+-keep interface com.deepion.kittypress.KittyPressNative$OutputSink {
+    int openOutput(java.lang.String);
+    void discardOutput(java.lang.String);
+}
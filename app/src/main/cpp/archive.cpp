@@ -3,125 +3,929 @@
 #include "compress.h"   // streaming compress/decompress helpers
 #include "kitty.h"
 #include "progress.h"
+#include "cancel.h"
+#include "budget.h"
+#include "workers.h"
+#include "kp_log.h"
+#include "varint.h"
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <memory>
 #include <vector>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
-#include <future>
 #include <thread>
 #include <atomic>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <iterator>
+#include <chrono>
+#include <unordered_set>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 namespace fs = std::filesystem;
 
-static void gatherFiles(const fs::path& base, const fs::path& p,
-                        vector<ArchiveInput>& list) {
+// Extension of a file name without the dot, same rules as fs::path::extension().
+static string extOf(const string& name) {
+    size_t dot = name.rfind('.');
+    if (dot == string::npos || dot == 0 || dot + 1 == name.size()) return "";
+    return name.substr(dot + 1);
+}
+
+// Parallel directory walker. Directories go on a shared queue; each worker
+// reads one directory at a time with readdir() and classifies entries by
+// d_type, so only regular files (for their size) and the rare DT_UNKNOWN /
+// symlink entries cost a stat. Like recursive_directory_iterator, symlinked
+// directories are not followed but symlinks to regular files are archived.
+class TreeScanner {
+public:
+    explicit TreeScanner(unsigned workers) : workers_(std::max(1u, workers)) {}
+
+    void scan(const string& absDir, const string& relDir, vector<ArchiveInput>& out) {
+        queue_.push_back({absDir, relDir});
+
+        vector<vector<ArchiveInput>> found(workers_);
+        runParallel(workers_, [this, &found](unsigned w) { run(found[w]); });
+
+        if (error_) std::rethrow_exception(error_);
+
+        size_t total = out.size();
+        for (auto& f : found) total += f.size();
+        out.reserve(total);
+        for (auto& f : found) {
+            std::move(f.begin(), f.end(), std::back_inserter(out));
+        }
+    }
+
+private:
+    struct Dir {
+        string abs;
+        string rel;
+    };
+
+    void run(vector<ArchiveInput>& out) {
+        while (true) {
+            Dir dir;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return !queue_.empty() || busy_ == 0 || error_; });
+                if (error_ || queue_.empty()) {
+                    cv_.notify_all();
+                    return;
+                }
+                dir = std::move(queue_.back());
+                queue_.pop_back();
+                ++busy_;
+            }
+
+            vector<Dir> subdirs;
+            try {
+                throwIfCancelled();
+                readDir(dir, out, subdirs);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_) error_ = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto& d : subdirs) queue_.push_back(std::move(d));
+                --busy_;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    static void readDir(const Dir& dir, vector<ArchiveInput>& out, vector<Dir>& subdirs) {
+        // closed on every way out; push_back can throw mid-listing
+        std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.abs.c_str()), &closedir);
+        if (!d) throw runtime_error("Cannot open directory: " + dir.abs);
+        const int dfd = dirfd(d.get());
 
-    if (fs::is_directory(p)) {
-        for (auto& e : fs::recursive_directory_iterator(p)) {
-            if (fs::is_regular_file(e.path())) {
-                string ext = e.path().extension().string();
-                if (!ext.empty() && ext[0] == '.') ext = ext.substr(1);
-
-                list.push_back({
-                                       e.path().string(),
-                                       fs::relative(e.path(), base).string(),
-                                       ext
-                               });
+        while (struct dirent* e = readdir(d.get())) {
+            const char* name = e->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            string abs = dir.abs + "/" + name;
+            string rel = dir.rel.empty() ? string(name) : dir.rel + "/" + name;
+
+            unsigned char type = e->d_type;
+            struct stat st{};
+            if (type == DT_UNKNOWN) {
+                if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+                     : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+                if (type == DT_UNKNOWN) continue;
+            }
+
+            if (type == DT_DIR) {
+                subdirs.push_back({std::move(abs), std::move(rel)});
+            } else if (type == DT_REG || type == DT_LNK) {
+                // regular file size, or the symlink's target (skipped unless a regular file)
+                const int flags = type == DT_REG ? AT_SYMLINK_NOFOLLOW : 0;
+                if ((st.st_mode == 0 || type == DT_LNK) && fstatat(dfd, name, &st, flags) != 0) continue;
+                if (!S_ISREG(st.st_mode)) continue;
+
+                string ext = extOf(name);
+                out.push_back({std::move(abs), std::move(rel), std::move(ext), (uint64_t)st.st_size});
             }
         }
-    } else if (fs::is_regular_file(p)) {
+    }
+
+    const unsigned workers_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    vector<Dir> queue_;
+    unsigned busy_ = 0;
+    std::exception_ptr error_;
+};
+
+static void gatherFiles(const fs::path& base, const fs::path& p,
+                        vector<ArchiveInput>& list) {
+
+    struct stat st{};
+    if (stat(p.c_str(), &st) != 0) return;
+
+    if (S_ISDIR(st.st_mode)) {
+        string rootRel = fs::relative(p, base).string();
+        if (rootRel == ".") rootRel.clear();
+
+        // stat-heavy work on flash storage overlaps well, even on few cores
+        const unsigned hw = std::thread::hardware_concurrency();
+        const unsigned workers = std::max(2u, std::min(4u, hw == 0 ? 2u : hw));
+
+        size_t first = list.size();
+        TreeScanner(workers).scan(p.string(), rootRel, list);
+
+        // workers finish in arbitrary order; keep archives reproducible
+        std::sort(list.begin() + (ptrdiff_t)first, list.end(),
+                  [](const ArchiveInput& a, const ArchiveInput& b) { return a.relPath < b.relPath; });
+    } else if (S_ISREG(st.st_mode)) {
 
         string name = p.filename().string();
-        string ext = p.extension().string();
-        if (!ext.empty() && ext[0] == '.') ext = ext.substr(1);
 
         list.push_back({
                                p.string(),
                                name,
-                               ext
+                               extOf(name),
+                               (uint64_t)st.st_size
                        });
     }
 }
 
-void createArchive(const vector<string>& inputs, const string& outputArchive) {
+// Owns the fd an input is read through.
+class InputFd {
+public:
+    explicit InputFd(int fd) : fd_(fd) {}
+    ~InputFd() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    InputFd(const InputFd&) = delete;
+    InputFd& operator=(const InputFd&) = delete;
+
+    int fd() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+// Through the opener for fd-backed lists, else by path.
+static int openInput(const ArchiveInput& f, const InputOpener& opener) {
+    if (opener) return opener(f);
+    return ::open(f.absPath.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+// Up to 'budget' bytes from the largest inputs, taken as slices spread over
+// each file so the level probe sees every kind of content a file holds.
+static string sampleInputs(const vector<ArchiveInput>& files, const InputOpener& opener,
+                           size_t budget) {
+    static const unsigned SLICES_PER_FILE = 4;
+
+    vector<const ArchiveInput*> biggest;
+    for (const auto& f : files) if (f.size) biggest.push_back(&f);
+    const size_t n = std::min<size_t>(biggest.size(), 8);
+    std::partial_sort(biggest.begin(), biggest.begin() + (ptrdiff_t)n, biggest.end(),
+                      [](const ArchiveInput* a, const ArchiveInput* b) { return a->size > b->size; });
+
+    string sample;
+    for (size_t i = 0; i < n; ++i) {
+        const ArchiveInput& f = *biggest[i];
+        const uint64_t slice = std::min<uint64_t>(f.size / SLICES_PER_FILE + 1, budget / n / SLICES_PER_FILE);
+        InputFd in(openInput(f, opener));
+        if (in.fd() < 0) continue;
+        for (unsigned k = 0; k < SLICES_PER_FILE; ++k) {
+            // centre of the k-th quarter
+            const uint64_t at = f.size * (2 * k + 1) / (2 * SLICES_PER_FILE);
+            const size_t pos = sample.size();
+            sample.resize(pos + (size_t)slice);
+            ssize_t got;
+            do {
+                got = ::pread(in.fd(), &sample[pos], (size_t)slice,
+                              (off_t)(at - std::min<uint64_t>(at, slice / 2)));
+            } while (got < 0 && errno == EINTR);
+            sample.resize(pos + (size_t)std::max<ssize_t>(got, 0));
+        }
+    }
+    return sample;
+}
+
+// Resolves opts.preset to a level. TimeBudget and TargetRatio compress a small
+// sample at increasing levels and keep the last (TimeBudget) or first
+// (TargetRatio) that meets the goal; the sample is cut short once it can't.
+static CompressOptions applyPreset(CompressOptions opts, const vector<ArchiveInput>& files,
+                                   uint64_t totalBytes, const InputOpener& opener) {
+    switch (opts.preset) {
+        case CompressPreset::Fastest:
+            opts.level = KP_FASTEST_LEVEL;
+            return opts;
+        case CompressPreset::Balanced:
+            opts.level = KP_DEFAULT_LEVEL;
+            return opts;
+        case CompressPreset::Smallest:
+            opts.level = KP_SMALLEST_LEVEL;
+            opts.longDistance = true;
+            return opts;
+        case CompressPreset::TimeBudget:
+            if (opts.timeBudgetSeconds == 0) throw runtime_error("Time budget not set");
+            break;
+        case CompressPreset::TargetRatio:
+            if (!(opts.targetRatio > 0)) throw runtime_error("Target ratio not set");
+            break;
+        default:
+            throw runtime_error("Unknown compression preset");
+    }
+
+    static const int LADDER[] = { KP_FASTEST_LEVEL, -5, -3, -1, 1, 3, 6, 9, 12, 15, KP_SMALLEST_LEVEL };
+    const string sample = sampleInputs(files, opener, 2u << 20);
+    if (sample.empty()) {
+        opts.level = KP_DEFAULT_LEVEL;
+        return opts;
+    }
+
+    // tables as for the biggest real payload; a sample-sized table is much faster
+    uint64_t biggest = 0;
+    for (const auto& f : files) biggest = std::max(biggest, f.size);
+
+    const bool timeBudget = opts.preset == CompressPreset::TimeBudget;
+    // leave room for reading, writing and the probe's optimism
+    const double allowed = opts.timeBudgetSeconds * 0.7;
+
+    opts.level = timeBudget ? KP_FASTEST_LEVEL : KP_SMALLEST_LEVEL;
+    for (int level : LADDER) {
+        throwIfCancelled();
+
+        const auto t0 = std::chrono::steady_clock::now();
+        const size_t n = probeCompress(sample.data(), sample.size(), level, biggest);
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        if (timeBudget) {
+            const unsigned parallel = std::max(1u, zstdWorkersForLevel(level));
+            const double estimate = secs * ((double)totalBytes / sample.size()) / parallel;
+            if (estimate > allowed) break;
+            opts.level = level;
+        } else if ((double)sample.size() / n >= opts.targetRatio) {
+            opts.level = level;
+            break;
+        }
+    }
+    return opts;
+}
+
+// Output side of createArchive()/resumeArchive(). One large buffer in front of
+// the archive fd turns the many small header and payload writes of an entry
+// into a few big pwrite()s. tellp() is answered from the buffer, and header
+// fields whose value is only known later are filled in with patch() (in the
+// buffer while they are still there, pwrite() otherwise) instead of a
+// seekp()/write()/seekp() round-trip that would flush the buffer each time.
+class ArchiveOutBuf : public std::streambuf {
+public:
+    // writes go to fd starting at file offset 'start'; takes ownership of fd
+    ArchiveOutBuf(int fd, uint64_t start, size_t bufferSize)
+            : fd_(fd), base_(start), buf_(bufferSize) {
+        setp(buf_.data(), buf_.data() + buf_.size());
+    }
+
+    ~ArchiveOutBuf() override {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    bool isOpen() const { return fd_ >= 0; }
+
+    bool patch(uint64_t pos, const void* p, size_t n) {
+        const char* src = static_cast<const char*>(p);
+        // the part still in the buffer
+        const uint64_t pending = (uint64_t)(pptr() - pbase());
+        if (pos + n > base_) {
+            const uint64_t from = std::max(pos, base_);
+            if (pos + n > base_ + pending) return false;
+            memcpy(pbase() + (from - base_), src + (from - pos), (size_t)(pos + n - from));
+            n = (size_t)(from - pos);
+        }
+        // the part already written
+        return n == 0 || writeAt(pos, src, n);
+    }
+
+    bool close() {
+        const bool ok = flushBuffer();
+        const int fd = fd_;
+        fd_ = -1;
+        return fd >= 0 && ::close(fd) == 0 && ok;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!flushBuffer()) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        const size_t room = (size_t)(epptr() - pptr());
+        if ((size_t)n <= room) {
+            memcpy(pptr(), s, (size_t)n);
+            pbump((int)n);
+            return n;
+        }
+        if (!flushBuffer()) return 0;
+        // compressed blocks as big as the buffer go straight through
+        if ((size_t)n >= buf_.size()) {
+            if (!writeAt(base_, s, (size_t)n)) return 0;
+            base_ += (uint64_t)n;
+            return n;
+        }
+        memcpy(pptr(), s, (size_t)n);
+        pbump((int)n);
+        return n;
+    }
+
+    int sync() override { return flushBuffer() ? 0 : -1; }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        const uint64_t cur = base_ + (uint64_t)(pptr() - pbase());
+        if (dir == std::ios_base::cur && off == 0) return pos_type((off_type)cur);  // tellp()
+        if (dir == std::ios_base::beg) return seekpos(pos_type(off), which);
+        if (dir == std::ios_base::cur) return seekpos(pos_type((off_type)cur + off), which);
+        return pos_type(off_type(-1));
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode) override {
+        if (pos < 0 || !flushBuffer()) return pos_type(off_type(-1));
+        base_ = (uint64_t)(off_type)pos;
+        return pos;
+    }
+
+private:
+    bool writeAt(uint64_t pos, const char* p, size_t n) {
+        while (n > 0) {
+            ssize_t w = ::pwrite(fd_, p, n, (off_t)pos);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            p += w;
+            n -= (size_t)w;
+            pos += (uint64_t)w;
+        }
+        return true;
+    }
+
+    bool flushBuffer() {
+        const size_t n = (size_t)(pptr() - pbase());
+        if (n == 0) return true;
+        if (fd_ < 0 || !writeAt(base_, pbase(), n)) return false;
+        base_ += n;
+        setp(buf_.data(), buf_.data() + buf_.size());
+        return true;
+    }
+
+    int fd_;
+    uint64_t base_; // file offset of the first buffered byte
+    vector<char> buf_;
+};
+
+class ArchiveOutput : public std::ostream {
+public:
+    // existing = false: create/truncate path; true: continue at 'start'
+    ArchiveOutput(const string& path, bool existing, uint64_t start = 0)
+            : std::ostream(nullptr),
+              buf_(::open(path.c_str(), O_WRONLY | O_CLOEXEC | (existing ? 0 : O_CREAT | O_TRUNC), 0644),
+                   start, engineLimits().writeBufferSize) {
+        rdbuf(&buf_);
+        if (!buf_.isOpen()) setstate(std::ios::badbit);
+    }
+
+    // Overwrites n bytes at absolute position pos (earlier in the archive).
+    void patch(std::streampos pos, const void* p, size_t n) {
+        if (!buf_.patch((uint64_t)(std::streamoff)pos, p, n)) setstate(std::ios::badbit);
+    }
+
+    void close() {
+        if (!buf_.close()) setstate(std::ios::badbit);
+    }
+
+private:
+    ArchiveOutBuf buf_;
+};
+
+// Sidecar "<archive>.kpck" that lets resumeArchive() continue a createArchive()
+// whose process was killed. Layout (little-endian):
+//   "KPCK" u8 version | u32 done, u64 offset | i32 level, u8 longDistance,
+//   u8 adaptiveLevel | u32 count, count x (u32 absLen, abs, u16 relLen, rel,
+//   u16 extLen, ext, u64 size)
+// 'done' entries are complete and the archive is final up to 'offset'. That
+// pair is rewritten in place with a single pwrite(), at most once a second;
+// jobs shorter than that never write a checkpoint at all.
+class ArchiveCheckpoint {
+public:
+    static string pathFor(const string& archivePath) { return archivePath + ".kpck"; }
+
+    // resuming: keep the existing file, only its progress record changes.
+    // opened: the inputs are read through an InputOpener, absPath is its handle
+    ArchiveCheckpoint(const string& archivePath, const vector<ArchiveInput>& files,
+                      const CompressOptions& opts, bool opened, bool resuming)
+            : path_(pathFor(archivePath)), files_(files), opts_(opts), opened_(opened),
+              last_(std::chrono::steady_clock::now()) {
+        if (resuming) {
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CLOEXEC);
+        } else {
+            ::unlink(path_.c_str()); // stale one from an older job
+        }
+    }
+
+    ~ArchiveCheckpoint() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    ArchiveCheckpoint(const ArchiveCheckpoint&) = delete;
+    ArchiveCheckpoint& operator=(const ArchiveCheckpoint&) = delete;
+
+    void update(ostream& out, uint32_t done, uint64_t offset) {
+        if (failed_) return;
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_ < std::chrono::seconds(1)) return;
+        last_ = now;
+
+        // the record must never point past bytes the kernel hasn't got yet
+        out.flush();
+        if (!out) return;
+
+        char rec[RECORD_SIZE];
+        memcpy(rec, &done, 4);
+        memcpy(rec + 4, &offset, 8);
+
+        bool ok;
+        if (fd_ < 0) {
+            string data = header();
+            memcpy(&data[RECORD_POS], rec, RECORD_SIZE);
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            ok = fd_ >= 0 && ::write(fd_, data.data(), data.size()) == (ssize_t)data.size();
+        } else {
+            ok = ::pwrite(fd_, rec, RECORD_SIZE, RECORD_POS) == (ssize_t)RECORD_SIZE;
+        }
+        if (!ok) {
+            // best effort: the archive itself is fine, it just can't be resumed
+            KP_LOGE("Cannot write checkpoint %s", path_.c_str());
+            failed_ = true;
+        }
+    }
+
+    void remove() {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+        ::unlink(path_.c_str());
+    }
+
+    static bool load(const string& archivePath, vector<ArchiveInput>& files,
+                     CompressOptions& opts, bool& opened, uint32_t& done, uint64_t& offset) {
+        ifstream in(pathFor(archivePath), ios::binary);
+        if (!in) return false;
+        const string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        size_t pos = 0;
+        auto take = [&](void* dst, size_t n) {
+            if (data.size() - pos < n) return false;
+            memcpy(dst, data.data() + pos, n);
+            pos += n;
+            return true;
+        };
+        auto takeString = [&](string& dst, size_t n) {
+            if (data.size() - pos < n) return false;
+            dst.assign(data, pos, n);
+            pos += n;
+            return true;
+        };
+
+        string magic;
+        uint8_t version = 0, longDistance = 0, adaptive = 0, byOpener = 0;
+        int32_t level = 0;
+        uint32_t count = 0;
+        if (!takeString(magic, 4) || magic != MAGIC || !take(&version, 1) || version != VERSION ||
+            !take(&done, 4) || !take(&offset, 8) || !take(&level, 4) ||
+            !take(&longDistance, 1) || !take(&adaptive, 1) || !take(&byOpener, 1) ||
+            !take(&count, 4) || done > count) {
+            return false;
+        }
+        opts.level = level;
+        opts.longDistance = longDistance != 0;
+        opts.adaptiveLevel = adaptive != 0;
+        opened = byOpener != 0;
+
+        files.clear();
+        for (uint32_t i = 0; i < count; ++i) {
+            ArchiveInput f;
+            uint32_t absLen = 0;
+            uint16_t relLen = 0, extLen = 0;
+            if (!take(&absLen, 4) || !takeString(f.absPath, absLen) ||
+                !take(&relLen, 2) || !takeString(f.relPath, relLen) ||
+                !take(&extLen, 2) || !takeString(f.ext, extLen) || !take(&f.size, 8)) {
+                return false;
+            }
+            files.push_back(std::move(f));
+        }
+        return pos == data.size();
+    }
+
+private:
+    static constexpr const char* MAGIC = "KPCK";
+    static const uint8_t VERSION = 3; // 2: the archive is v6, 3: opener inputs
+    static const size_t RECORD_POS = 5;
+    static const size_t RECORD_SIZE = 12;
+
+    string header() const {
+        string h(MAGIC, 4);
+        h.push_back((char)VERSION);
+        h.append(RECORD_SIZE, '\0');
+        auto put = [&h](const void* p, size_t n) { h.append(static_cast<const char*>(p), n); };
+
+        const int32_t level = opts_.level;
+        const uint8_t longDistance = opts_.longDistance, adaptive = opts_.adaptiveLevel;
+        const uint8_t byOpener = opened_;
+        const uint32_t count = (uint32_t)files_.size();
+        put(&level, 4);
+        put(&longDistance, 1);
+        put(&adaptive, 1);
+        put(&byOpener, 1);
+        put(&count, 4);
+        for (const auto& f : files_) {
+            const uint32_t absLen = (uint32_t)f.absPath.size();
+            const uint16_t relLen = (uint16_t)f.relPath.size(), extLen = (uint16_t)f.ext.size();
+            put(&absLen, 4);
+            h += f.absPath;
+            put(&relLen, 2);
+            h += f.relPath;
+            put(&extLen, 2);
+            h += f.ext;
+            put(&f.size, 8);
+        }
+        return h;
+    }
+
+    const string path_;
+    const vector<ArchiveInput>& files_;
+    const CompressOptions opts_;
+    const bool opened_;
+    std::chrono::steady_clock::time_point last_;
+    int fd_ = -1;
+    bool failed_ = false;
+};
+
+// Extension a v6 reader derives for 'rel' when the entry stores none.
+static string pathExtOf(const string& rel) {
+    const size_t slash = rel.rfind('/');
+    return extOf(slash == string::npos ? rel : rel.substr(slash + 1));
+}
+
+// Entries up to this size are compressed into memory first, so their header can
+// carry the payload size as a minimal varint; larger ones are streamed into the
+// archive and get a padded varint that is patched afterwards.
+static const uint64_t SMALL_ENTRY_SIZE = 1024 * 1024;
+
+// Writes entries [first, files.size()) at the current position of 'out'.
+// v6 entry layout (little-endian, varints are LEB128, see varint.h):
+//   varint shared, varint suffixLen, suffix   path = first 'shared' bytes of the
+//                                              previous entry's path + suffix
+//   u8 flags | varint origSize
+//   [varint extLen, ext]                      KP_ENTRY_HAS_EXT only; otherwise the
+//                                              ext is the path's own extension
+//   varint payloadSize | [u64 checksum]       KP_ENTRY_HAS_CHECKSUM
+//   payload in the compact layout (PayloadLayout), payloadSize bytes
+static void writeEntries(ArchiveOutput& out, const vector<ArchiveInput>& files, size_t first,
+                         const CompressOptions& opts, const InputOpener& opener,
+                         ArchiveCheckpoint* checkpoint) {
+    CompressOptions entryOpts = opts;
+    entryOpts.compactPayload = true;
+    std::ostringstream smallPayload;
+
+    for (size_t i = first; i < files.size(); ++i) {
+        const auto& f = files[i];
+        throwIfCancelled();
+
+        // shared path prefix with the previous entry (sorted paths share a lot)
+        const string& prev = i > 0 ? files[i - 1].relPath : string();
+        const size_t maxShared = std::min(prev.size(), f.relPath.size());
+        size_t shared = 0;
+        while (shared < maxShared && prev[shared] == f.relPath[shared]) ++shared;
+
+        InputFd input(openInput(f, opener));
+        if (input.fd() < 0) throw runtime_error("Cannot open input: " + f.relPath);
+
+        // The size of what is read now, not what the scan or a provider reported;
+        // it is pledged to zstd, so a file that changes while read fails the entry.
+        struct stat st;
+        if (::fstat(input.fd(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            throw runtime_error("Input is not a regular file: " + f.relPath);
+        }
+
+        uint8_t flags = KP_ENTRY_COMPRESSED | KP_ENTRY_HAS_CHECKSUM;
+        if (f.ext != pathExtOf(f.relPath)) flags |= KP_ENTRY_HAS_EXT;
+        const uint64_t origSize = (uint64_t)st.st_size;
+        uint64_t dataSize = 0;
+        uint64_t checksum = 0;
+
+        writeVarint(out, shared);
+        writeVarint(out, f.relPath.size() - shared);
+        out.write(f.relPath.data() + shared, (streamsize)(f.relPath.size() - shared));
+        out.write(reinterpret_cast<const char*>(&flags), 1);
+        writeVarint(out, origSize);
+        if (flags & KP_ENTRY_HAS_EXT) {
+            writeVarint(out, f.ext.size());
+            out.write(f.ext.data(), (streamsize)f.ext.size());
+        }
+
+        std::streampos endPos;
+        if (origSize <= SMALL_ENTRY_SIZE) {
+            smallPayload.str(string());
+            smallPayload.clear();
+            compressToStream(input.fd(), origSize, smallPayload, dataSize, &checksum, entryOpts);
+            const string payload = smallPayload.str();
+
+            writeVarint(out, dataSize);
+            out.write(reinterpret_cast<const char*>(&checksum), 8);
+            out.write(payload.data(), (streamsize)payload.size());
+            endPos = out.tellp();
+        } else {
+            // Reserve space for dataSize and the checksum (known after streaming)
+            std::streampos sizesPos = out.tellp();
+            char sizes[KP_VARINT_MAX_BYTES + 8] = {};
+            out.write(sizes, sizeof(sizes));
+
+            // Now stream the payload directly into the archive (no .tmpkitty)
+            compressToStream(input.fd(), origSize, out, dataSize, &checksum, entryOpts);
+
+            // Patch dataSize and checksum with the real values
+            endPos = out.tellp();
+            encodePaddedVarint(dataSize, sizes);
+            memcpy(sizes + KP_VARINT_MAX_BYTES, &checksum, 8);
+            out.patch(sizesPos, sizes, sizeof(sizes));
+        }
+        if (!out) throw runtime_error("Failed to write archive");
+
+        cout << "  + " << f.relPath << " (" << origSize << " → " << dataSize << ")\n";
+        if (checkpoint) checkpoint->update(out, (uint32_t)(i + 1), (uint64_t)endPos);
+    }
+}
+
+// Shared by both createArchive() overloads; opener is empty for path inputs.
+static void writeArchive(const vector<ArchiveInput>& files, const InputOpener& opener,
+                         const string& outputArchive, const CompressOptions& opts) {
+    // compute total original size for progress reporting (sizes come from the scan)
+    uint64_t totalOrig = 0;
+    for (auto &f : files) totalOrig += f.size;
+    native_progress_set_total(totalOrig);
+
+    const CompressOptions resolved = applyPreset(opts, files, totalOrig, opener);
+    KP_LOGI("Compression level %d%s", resolved.level, resolved.longDistance ? " (long distance)" : "");
+
+    ArchiveOutput out(outputArchive, false);
+    if (!out) throw runtime_error("Cannot open output archive");
+    // opener inputs can only be reopened by a later process through their handles
+    const bool reopenable = !opener || std::all_of(files.begin(), files.end(),
+            [](const ArchiveInput& f) { return !f.absPath.empty(); });
+    std::unique_ptr<ArchiveCheckpoint> checkpoint;
+    if (reopenable) {
+        checkpoint.reset(new ArchiveCheckpoint(outputArchive, files, resolved, (bool)opener, false));
+    }
+
+    try {
+        // overall archive magic & version
+        out.write(KITTY_MAGIC.c_str(), (streamsize)KITTY_MAGIC.size());
+        uint8_t ver = KITTY_VERSION;
+        out.write(reinterpret_cast<const char*>(&ver), 1);
+
+        uint32_t count = (uint32_t)files.size();
+        out.write(reinterpret_cast<const char*>(&count), 4);
+
+        cout << "Creating archive with " << count << " file(s)\n";
+
+        writeEntries(out, files, 0, resolved, opener, checkpoint.get());
+        out.close();
+        if (!out) throw runtime_error("Failed to write archive");
+    } catch (...) {
+        // failed or cancelled: don't leave a half-written archive behind
+        // (only a killed process leaves one, together with its checkpoint)
+        out.close();
+        if (checkpoint) checkpoint->remove();
+        std::error_code ec;
+        fs::remove(outputArchive, ec);
+        throw;
+    }
+
+    if (checkpoint) checkpoint->remove();
+    cout << "Archive created: " << outputArchive << endl;
+}
+
+void createArchive(const vector<string>& inputs, const string& outputArchive,
+                   const CompressOptions& opts) {
     vector<ArchiveInput> files;
     for (auto& in : inputs)
         gatherFiles(fs::absolute(in).parent_path(), fs::absolute(in), files);
 
-    // compute total original size for progress reporting (copy phase)
-    // keep this as original behavior so native_progress_set_total reflects 'copying' bytes
-    uint64_t totalOrig = 0;
-    for (auto &f : files) {
-        try {
-            if (fs::exists(f.absPath)) {
-                totalOrig += (uint64_t)fs::file_size(f.absPath);
-            }
-        } catch (...) { }
+    writeArchive(files, InputOpener(), outputArchive, opts);
+}
+
+void createArchive(const vector<ArchiveInput>& files, const InputOpener& open,
+                   const string& outputArchive, const CompressOptions& opts) {
+    if (!open) throw runtime_error("No input opener");
+    vector<ArchiveInput> named = files;
+    for (auto& f : named) f.ext = pathExtOf(f.relPath);
+    writeArchive(named, open, outputArchive, opts);
+}
+
+bool canResumeArchive(const string& outputArchive) {
+    vector<ArchiveInput> files;
+    CompressOptions opts;
+    bool opened = false;
+    uint32_t done = 0;
+    uint64_t offset = 0;
+    if (!ArchiveCheckpoint::load(outputArchive, files, opts, opened, done, offset)) return false;
+
+    std::error_code ec;
+    const uint64_t size = fs::file_size(outputArchive, ec);
+    return !ec && size >= offset;
+}
+
+void resumeArchive(const string& outputArchive, const InputOpener& open) {
+    vector<ArchiveInput> files;
+    CompressOptions opts;
+    bool opened = false;
+    uint32_t done = 0;
+    uint64_t offset = 0;
+    if (!ArchiveCheckpoint::load(outputArchive, files, opts, opened, done, offset)) {
+        throw runtime_error("No checkpoint to resume from");
+    }
+    if (opened && !open) throw runtime_error("No input opener");
+
+    uint64_t totalOrig = 0, doneOrig = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        totalOrig += files[i].size;
+        if (i < done) doneOrig += files[i].size;
     }
     native_progress_set_total(totalOrig);
+    native_progress_add_processed(doneOrig);
+
+    // Drop whatever the killed run wrote after its last checkpoint.
+    std::error_code ec;
+    const uint64_t size = fs::file_size(outputArchive, ec);
+    if (ec || size < offset) throw runtime_error("Archive is shorter than its checkpoint");
+    fs::resize_file(outputArchive, offset);
+
+    // sanity: the checkpoint must belong to this archive
+    {
+        ifstream in(outputArchive, ios::binary);
+        string magic(KITTY_MAGIC.size(), '\0');
+        uint8_t ver = 0;
+        uint32_t count = 0;
+        in.read(&magic[0], (streamsize)magic.size());
+        in.read(reinterpret_cast<char*>(&ver), 1);
+        in.read(reinterpret_cast<char*>(&count), 4);
+        if (!in || magic != KITTY_MAGIC || ver != KITTY_VERSION || count != files.size()) {
+            throw runtime_error("Checkpoint does not match the archive");
+        }
+    }
 
-    ofstream out(outputArchive, ios::binary);
+    ArchiveOutput out(outputArchive, true, offset);
     if (!out) throw runtime_error("Cannot open output archive");
 
-    // overall archive magic & version
-    out.write(KITTY_MAGIC.c_str(), (streamsize)KITTY_MAGIC.size());
-    uint8_t ver = KITTY_VERSION;
-    out.write(reinterpret_cast<const char*>(&ver), 1);
+    KP_LOGI("Resuming archive at entry %u of %zu", done, files.size());
+    ArchiveCheckpoint checkpoint(outputArchive, files, opts, opened, true);
 
-    uint32_t count = (uint32_t)files.size();
-    out.write(reinterpret_cast<const char*>(&count), 4);
+    try {
+        writeEntries(out, files, done, opts, opened ? open : InputOpener(), &checkpoint);
+        out.close();
+        if (!out) throw runtime_error("Failed to write archive");
+    } catch (...) {
+        out.close();
+        checkpoint.remove();
+        fs::remove(outputArchive, ec);
+        throw;
+    }
 
-    cout << "Creating archive with " << count << " file(s)\n";
+    checkpoint.remove();
+}
 
-    for (auto& f : files) {
-        uint16_t pathLen = (uint16_t)f.relPath.size();
-        uint8_t flags = 1;
-        uint64_t origSize = 0;
-        try { origSize = (uint64_t)fs::file_size(f.absPath); } catch (...) { origSize = 0; }
-        uint64_t dataSize = 0; // will be patched after streaming KP05 payload
-        uint16_t extLen = (uint16_t)f.ext.size();
 
-        // Entry header
-        out.write(reinterpret_cast<const char*>(&pathLen), 2);
-        out.write(f.relPath.c_str(), pathLen);
-        out.write(reinterpret_cast<const char*>(&flags), 1);
-        out.write(reinterpret_cast<const char*>(&origSize), 8);
+// Longest entry path accepted (listNative() hands lengths to Kotlin as u16)
+static const uint64_t MAX_ENTRY_PATH = 0xFFFF;
 
-        // Reserve space for dataSize (we don't know it yet)
-        std::streampos dataSizePos = out.tellp();
-        out.write(reinterpret_cast<const char*>(&dataSize), 8); // placeholder
+// Entry headers of a v6 archive (layout at writeEntries()).
+static std::vector<ArchiveEntry> readCompactIndex(std::istream& in, uint32_t count) {
+    std::vector<ArchiveEntry> entries;
+    entries.reserve(count);
 
-        // Store extension (no leading dot)
-        out.write(reinterpret_cast<const char*>(&extLen), 2);
-        if (extLen > 0) out.write(f.ext.c_str(), extLen);
+    std::string prev;
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint64_t shared = readVarint(in);
+        const uint64_t suffixLen = readVarint(in);
+        if (shared > prev.size() || suffixLen > MAX_ENTRY_PATH - shared) {
+            throw std::runtime_error("Invalid entry path");
+        }
 
-        // Now stream KP05 payload directly into the archive (no .tmpkitty)
-        uint64_t payloadSize = 0;
-        // compressToStream writes a KP05-wrapped payload starting at current stream pos
-        compressToStream(f.absPath, out, payloadSize);
+        ArchiveEntry e;
+        e.rel.reserve((size_t)(shared + suffixLen));
+        e.rel.assign(prev, 0, (size_t)shared);
+        e.rel.resize((size_t)(shared + suffixLen));
+        if (suffixLen) in.read(&e.rel[(size_t)shared], (std::streamsize)suffixLen);
 
-        // Patch dataSize with actual payload size
-        std::streampos endPos = out.tellp();
-        dataSize = payloadSize;
-        out.seekp(dataSizePos);
-        out.write(reinterpret_cast<const char*>(&dataSize), 8);
-        out.seekp(endPos);
+        in.read(reinterpret_cast<char*>(&e.flags), 1);
+        if (e.flags & ~KP_ENTRY_FLAGS_V6) throw std::runtime_error("Unsupported entry flags");
+        e.origSize = readVarint(in);
 
-        cout << "  + " << f.relPath << " (" << origSize << " → " << dataSize << ")\n";
+        if (e.flags & KP_ENTRY_HAS_EXT) {
+            const uint64_t extLen = readVarint(in);
+            if (extLen > 255) throw std::runtime_error("Invalid entry extension");
+            e.ext.resize((size_t)extLen);
+            if (extLen) in.read(&e.ext[0], (std::streamsize)extLen);
+        } else {
+            e.ext = pathExtOf(e.rel);
+        }
+
+        e.dataSize = readVarint(in);
+        e.checksum = 0;
+        if (e.flags & KP_ENTRY_HAS_CHECKSUM) in.read(reinterpret_cast<char*>(&e.checksum), 8);
+        e.compactPayload = true;
+
+        std::streampos payloadPos = in.tellg();
+        if (!in.good() || payloadPos == std::streampos(-1)) {
+            throw std::runtime_error("Failed to read entry header");
+        }
+        e.payloadOffset = static_cast<uint64_t>(payloadPos);
+
+        in.seekg((std::streamoff)e.dataSize, std::ios::cur);
+        if (!in.good()) throw std::runtime_error("Unexpected EOF while skipping entry payload");
+
+        prev = e.rel;
+        entries.push_back(std::move(e));
     }
 
-    out.close();
-    cout << "Archive created: " << outputArchive << endl;
+    return entries;
 }
 
+// What the payload decoders need to know about an entry's payload layout.
+static PayloadLayout layoutOf(const ArchiveEntry& e) {
+    PayloadLayout layout;
+    if (e.compactPayload) {
+        layout.compact = true;
+        layout.payloadSize = e.dataSize;
+        layout.origSize = e.origSize;
+        layout.ext = e.ext;
+    }
+    return layout;
+}
 
-std::string extractArchive(const std::string& archivePath, const std::string& outputFolder) {
+// Decoder memory for the largest window among the entries (long-distance ones
+// go up to 128 MiB), for extractWorkersFor()/verifyWorkersFor(). Payloads no
+// larger than the default window can't need more than the default decoder, so
+// only the headers of bigger ones are read.
+static uint64_t largestDecoderSize(const std::string& archivePath,
+                                   const std::vector<ArchiveEntry>& entries) {
     std::ifstream in(archivePath, std::ios::binary);
-    if (!in) throw std::runtime_error("Cannot open archive");
+    const uint64_t defaultWindow = defaultWindowSize();
+    uint64_t largest = 0;
+    for (const auto& e : entries) {
+        if (e.origSize <= defaultWindow) continue;
+        in.clear();
+        in.seekg((std::streamoff)e.payloadOffset);
+        largest = std::max(largest, payloadDecoderSize(in, layoutOf(e)));
+    }
+    return largest;
+}
 
+// Reads the archive header and every entry header, recording payload offsets.
+// Payloads are skipped with seekg, nothing is decompressed.
+static std::vector<ArchiveEntry> readArchiveIndex(std::istream& in) {
     std::string magic(KITTY_MAGIC.size(), '\0');
     in.read(&magic[0], (streamsize)magic.size());
     if (magic != KITTY_MAGIC)
@@ -129,31 +933,19 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
 
     uint8_t ver;
     in.read(reinterpret_cast<char*>(&ver), 1);
-    if (ver != KITTY_VERSION) {
-        // for now we only support KP05 archives
+    if (ver < KITTY_MIN_VERSION || ver > KITTY_VERSION) {
         throw std::runtime_error("Unsupported archive version");
     }
 
     uint32_t count;
     in.read(reinterpret_cast<char*>(&count), 4);
+    if (!in.good()) throw std::runtime_error("Failed to read archive header");
 
-    struct Entry {
-        std::string rel;
-        std::string ext;        // stored extension (may be empty)
-        uint8_t flags;
-        uint64_t origSize;
-        uint64_t dataSize;      // size of KP05 payload in archive
-        uint64_t payloadOffset; // file offset where KP05 payload begins
-    };
+    if (ver >= 6) return readCompactIndex(in, count);
 
-    std::vector<Entry> entries;
+    std::vector<ArchiveEntry> entries;
     entries.reserve(count);
-    std::vector<std::string> relPaths;
-    relPaths.reserve(count);
 
-    uint64_t totalCompressed = 0;
-
-    // First pass: read all headers, record payload offsets, skip payloads
     for (uint32_t i = 0; i < count; ++i) {
         uint16_t pathLen;
         in.read(reinterpret_cast<char*>(&pathLen), 2);
@@ -163,6 +955,7 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
 
         uint8_t flags;
         in.read(reinterpret_cast<char*>(&flags), 1);
+        if (flags & ~KP_ENTRY_FLAGS_V5) throw std::runtime_error("Unsupported entry flags");
 
         uint64_t origSize = 0, dataSize = 0;
         in.read(reinterpret_cast<char*>(&origSize), 8);
@@ -174,6 +967,10 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
         std::string ext(extLen, '\0');
         if (extLen > 0) in.read(&ext[0], extLen);
 
+        // content checksum (older archives don't carry one)
+        uint64_t checksum = 0;
+        if (flags & KP_ENTRY_HAS_CHECKSUM) in.read(reinterpret_cast<char*>(&checksum), 8);
+
         // remember where the KP05 payload starts
         std::streampos payloadPos = in.tellg();
         if (payloadPos == std::streampos(-1)) {
@@ -189,17 +986,122 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
         }
 
         entries.push_back({
-                                  rel,
-                                  ext,
+                                  std::move(rel),
+                                  std::move(ext),
                                   flags,
                                   origSize,
                                   dataSize,
-                                  static_cast<uint64_t>(payloadPos)
+                                  static_cast<uint64_t>(payloadPos),
+                                  checksum,
+                                  false
                           });
-        relPaths.push_back(rel);
+    }
+
+    return entries;
+}
+
+std::vector<ArchiveEntry> listArchive(const std::string& archivePath) {
+    std::ifstream in(archivePath, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open archive");
+    return readArchiveIndex(in);
+}
+
+// Resume mode: true if an earlier run already left entry 'e' intact at outPath.
+// Entries without a stored checksum can't be verified and are extracted again.
+static bool entryAlreadyExtracted(std::istream& in, const ArchiveEntry& e, int dirFd,
+                                  const std::string& outPath) {
+    if (!(e.flags & KP_ENTRY_HAS_CHECKSUM)) return false;
+    in.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
+    if (!in.good()) throw std::runtime_error("Failed to seek to payload");
+    return outputMatchesPayload(in, dirFd, outPath, e.checksum, layoutOf(e));
+}
+
+// Where an entry goes, relative to the extraction root: its path with the stored
+// extension in place of the one in the name (as fs::path::replace_extension does).
+static std::string entryOutputPath(const ArchiveEntry& e) {
+    if (e.ext.empty()) return e.rel;
+    const size_t slash = e.rel.rfind('/');
+    const size_t nameStart = slash == std::string::npos ? 0 : slash + 1;
+    const size_t dot = e.rel.rfind('.');
+    const size_t stemEnd = (dot != std::string::npos && dot > nameStart) ? dot : e.rel.size();
+    return e.rel.substr(0, stemEnd) + "." + e.ext;
+}
+
+// Creates the directories the outputs need below rootFd, parents first and each
+// one once, with mkdirat() relative to the root. Replaces a create_directories()
+// (a stat per path component) for every entry.
+static void createOutputDirs(int rootFd, const std::vector<std::string>& outPaths) {
+    std::unordered_set<std::string> created;
+    std::string lastParent;
+    for (const auto& p : outPaths) {
+        const size_t slash = p.rfind('/');
+        if (slash == std::string::npos) continue;
+        // entries are stored directory by directory: most share the previous parent
+        if (slash == lastParent.size() && p.compare(0, slash, lastParent) == 0) continue;
+        lastParent.assign(p, 0, slash);
+
+        for (size_t pos = p.find('/'); pos != std::string::npos && pos <= slash;
+             pos = p.find('/', pos + 1)) {
+            std::string dir(p, 0, pos);
+            if (dir.empty() || !created.insert(dir).second) continue;
+            if (::mkdirat(rootFd, dir.c_str(), 0777) != 0 && errno != EEXIST) {
+                throw std::runtime_error("Cannot create directory: " + dir);
+            }
+        }
+    }
+}
+
+// Open directory that extraction creates files relative to.
+class DirHandle {
+public:
+    explicit DirHandle(const std::string& path)
+            : fd_(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+        if (fd_ < 0) throw std::runtime_error("Cannot open output folder");
+    }
+    ~DirHandle() { ::close(fd_); }
+
+    DirHandle(const DirHandle&) = delete;
+    DirHandle& operator=(const DirHandle&) = delete;
+
+    int fd() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+// Name of what extraction creates in the output folder: the file itself for a
+// single entry (KittyPress_<name.ext>), else a folder named after the entries'
+// common top-level folder, or KittyPress_Files if they don't share one.
+static std::string extractionRootName(const std::vector<ArchiveEntry>& entries) {
+    if (entries.empty()) return "KittyPress_Empty";
+
+    if (entries.size() == 1) {
+        fs::path p(entries[0].rel);
+        // if extension was stored, ensure filename has it
+        if (!entries[0].ext.empty()) p.replace_extension("." + entries[0].ext);
+        return "KittyPress_" + p.filename().string();
+    }
 
-        totalCompressed += dataSize;
+    const std::string& first = entries[0].rel;
+    const size_t slash = first.find('/');
+    if (slash == std::string::npos || slash == 0) return "KittyPress_Files";
+    const std::string topSlash = first.substr(0, slash + 1);
+    for (size_t i = 1; i < entries.size(); ++i) {
+        if (entries[i].rel.compare(0, topSlash.size(), topSlash) != 0) return "KittyPress_Files";
     }
+    return "KittyPress_" + first.substr(0, slash);
+}
+
+std::string extractArchive(const std::string& archivePath, const std::string& outputFolder,
+                           bool resume) {
+    std::ifstream in(archivePath, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open archive");
+
+    // First pass: read all headers, record payload offsets, skip payloads
+    std::vector<ArchiveEntry> entries = readArchiveIndex(in);
+
+    uint64_t totalCompressed = 0;
+    for (const auto &e : entries) totalCompressed += e.dataSize;
 
     // Set total compressed bytes for extraction progress
     native_progress_reset();
@@ -209,30 +1111,22 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
     static const uint64_t PROGRESS_BATCH = 1024ull * 1024ull;
     uint64_t progressBatch = 0;
 
-    // Decide extraction root
-    std::string finalRootName;
+    std::string finalRootName = extractionRootName(entries);
 
     if (entries.empty()) {
-        finalRootName = "KittyPress_Empty";
         in.close();
         return finalRootName;
     } else if (entries.size() == 1) {
-        // single entry -> create single file named KittyPress_<filename.ext>
-        fs::path p(relPaths[0]);
-        std::string filename = p.filename().string();
-
-        // if extension was stored, ensure filename has it
-        if (!entries[0].ext.empty()) {
-            p.replace_extension("." + entries[0].ext);
-            filename = p.filename().string();
-        }
-
-        finalRootName = "KittyPress_" + filename;
-        fs::path outRoot = fs::path(outputFolder) / finalRootName;
-        fs::create_directories(outRoot.parent_path());
-
         auto &e = entries[0];
         fs::path outPath = fs::path(outputFolder) / finalRootName;
+        fs::create_directories(outPath.parent_path());
+
+        if (resume && entryAlreadyExtracted(in, e, AT_FDCWD, outPath.string())) {
+            KP_LOGI("Resume: %s already extracted", e.rel.c_str());
+            native_progress_add_processed(e.dataSize);
+            in.close();
+            return finalRootName;
+        }
 
         // move to payload position
         in.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
@@ -242,7 +1136,7 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
         }
 
         // Decompress directly from archive stream (KP05 payload)
-        decompressFromStream(in, e.dataSize, outPath.string());
+        decompressFromStream(in, e.dataSize, outPath.string(), layoutOf(e));
 
         // report progress for this single entry
         progressBatch += e.dataSize;
@@ -253,80 +1147,320 @@ std::string extractArchive(const std::string& archivePath, const std::string& ou
 
         in.close();
         return finalRootName;
-    } else {
-        // multiple entries -> detect if all share a single top-level folder
-        auto splitTop = [](const std::string &s) -> std::string {
-            size_t pos = s.find('/');
-            if (pos == std::string::npos) return "";
-            return s.substr(0, pos);
-        };
+    }
 
-        auto starts_with = [](const std::string& s, const std::string& prefix) {
-            return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
-        };
+    // Create extraction root directory
+    fs::path rootOut = fs::path(outputFolder) / finalRootName;
+    const bool rootExisted = fs::exists(rootOut);
+    fs::create_directories(rootOut);
+    DirHandle root(rootOut.string());
+
+    // Prepare output paths (relative to the root) and their directories first,
+    // single-threaded; workers then only create files with openat().
+    std::vector<std::string> outPaths(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) outPaths[i] = entryOutputPath(entries[i]);
+    createOutputDirs(root.fd(), outPaths);
+
+    // Multi-thread extraction by entry on the shared pool (safe: each task uses
+    // its own ifstream). Worker count comes from the memory budget and the largest
+    // window of this archive (at most 4, one per core).
+    const unsigned workers = std::max(1u, extractWorkersFor(largestDecoderSize(archivePath, entries)));
+    std::atomic<size_t> nextIndex{0};
+    std::atomic<bool> stop{false}; // set by the first failing worker (or on cancel)
+    std::atomic<size_t> skipped{0};
+    // outputs this run created, the only ones a failed run removes again
+    std::unique_ptr<bool[]> created(new bool[entries.size()]());
+
+    std::exception_ptr firstError;
+    try {
+        runParallel(workers, [&](unsigned) {
+            try {
+                // one archive stream per worker, not per entry
+                std::ifstream localIn(archivePath, std::ios::binary);
+                if (!localIn) throw std::runtime_error("Cannot open archive worker stream");
+
+                while (!stop.load(std::memory_order_relaxed)) {
+                    throwIfCancelled();
+
+                    size_t i = nextIndex.fetch_add(1);
+                    if (i >= entries.size()) break;
 
-        std::string firstTop = splitTop(relPaths[0]);
-        bool allSameTop = !firstTop.empty();
-        if (allSameTop) {
-            for (size_t i = 1; i < relPaths.size(); ++i) {
-                if (!starts_with(relPaths[i], firstTop + "/")) {
-                    allSameTop = false;
-                    break;
+                    const auto &e = entries[i];
+                    localIn.clear();
+
+                    if (resume && entryAlreadyExtracted(localIn, e, root.fd(), outPaths[i])) {
+                        skipped.fetch_add(1, std::memory_order_relaxed);
+                        native_progress_add_processed(e.dataSize);
+                        continue;
+                    }
+
+                    localIn.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
+                    if (!localIn.good()) throw std::runtime_error("Failed to seek to payload");
+
+                    decompressFromStream(localIn, e.dataSize, root.fd(), outPaths[i], layoutOf(e),
+                                         &created[i]);
+                    native_progress_add_processed(e.dataSize);
                 }
+            } catch (...) {
+                stop.store(true);
+                throw;
             }
-        }
+        });
+    } catch (...) {
+        firstError = std::current_exception();
+    }
 
-        if (allSameTop) {
-            finalRootName = "KittyPress_" + firstTop;
-        } else {
-            finalRootName = "KittyPress_Files";
+    if (resume) KP_LOGI("Resume: %zu of %zu entries already extracted", skipped.load(), entries.size());
+
+    if (firstError) {
+        in.close();
+        // remove partial output of this run; a resumed run keeps finished entries
+        // for the next attempt (decompressFromStream already removed the broken one).
+        // In a root that was there before, files this run didn't create stay.
+        std::error_code ec;
+        if (!resume && !rootExisted) {
+            fs::remove_all(rootOut, ec);
+        } else if (!resume) {
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (created[i]) ::unlinkat(root.fd(), outPaths[i].c_str(), 0);
+            }
         }
+        std::rethrow_exception(firstError);
     }
 
-    // Create extraction root directory
-    fs::path rootOut = fs::path(outputFolder) / finalRootName;
-    fs::create_directories(rootOut);
+    in.close();
+    return finalRootName; // return root folder name
+}
+
+// fd-backed extraction opens this many outputs at a time (fewer if they add up
+// to OUTPUT_BATCH_BYTES) and decodes them in parallel before opening the next.
+static const size_t OUTPUT_BATCH_ENTRIES = 64;
+static const uint64_t OUTPUT_BATCH_BYTES = 64ull * 1024 * 1024;
+
+std::string extractArchive(const std::string& archivePath, const OutputOpener& open,
+                           bool resume, const OutputDiscarder& discard) {
+    if (!open) throw std::runtime_error("No output opener");
+
+    std::vector<ArchiveEntry> entries;
+    {
+        std::ifstream in(archivePath, std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot open archive");
+        entries = readArchiveIndex(in);
+    }
+
+    uint64_t totalCompressed = 0;
+    for (const auto &e : entries) totalCompressed += e.dataSize;
+    native_progress_reset();
+    native_progress_set_total(totalCompressed);
 
-    // Prepare output paths first (single-threaded directory creation).
+    const std::string finalRootName = extractionRootName(entries);
     std::vector<std::string> outPaths(entries.size());
-    for (size_t i = 0; i < entries.size(); ++i) {
-        auto &e = entries[i];
-        fs::path relp(e.rel);
-        fs::path outPath = rootOut / relp;
-        if (!e.ext.empty()) outPath.replace_extension("." + e.ext);
-        fs::create_directories(outPath.parent_path());
-        outPaths[i] = outPath.string();
+    if (entries.size() == 1) {
+        outPaths[0] = finalRootName;
+    } else {
+        for (size_t i = 0; i < entries.size(); ++i) outPaths[i] = entryOutputPath(entries[i]);
     }
 
-    // Multi-thread extraction by entry (safe: each task uses its own ifstream).
-    const unsigned hw = std::thread::hardware_concurrency();
-    const unsigned workers = std::max(1u, std::min(4u, hw == 0 ? 2u : hw));
-    std::atomic<size_t> nextIndex{0};
+    const unsigned workers = std::max(1u, extractWorkersFor(largestDecoderSize(archivePath, entries)));
+    size_t skipped = 0;
+    std::vector<int> fds;
 
-    std::vector<std::future<void>> tasks;
-    tasks.reserve(workers);
+    for (size_t first = 0; first < entries.size();) {
+        throwIfCancelled();
 
-    for (unsigned w = 0; w < workers; ++w) {
-        tasks.push_back(std::async(std::launch::async, [&, w]() {
-            while (true) {
-                size_t i = nextIndex.fetch_add(1);
-                if (i >= entries.size()) break;
+        size_t last = first;
+        uint64_t batchBytes = 0;
+        while (last < entries.size() && last - first < OUTPUT_BATCH_ENTRIES &&
+               batchBytes < OUTPUT_BATCH_BYTES) {
+            batchBytes += entries[last++].origSize;
+        }
 
-                const auto &e = entries[i];
-                std::ifstream localIn(archivePath, std::ios::binary);
-                if (!localIn) throw std::runtime_error("Cannot open archive worker stream");
+        // the opener may call back into the VM: only this thread uses it
+        fds.assign(last - first, -1);
+        auto closeBatch = [&fds]() {
+            for (int& fd : fds) {
+                if (fd >= 0) ::close(fd);
+                fd = -1;
+            }
+        };
+        // outputs written (or skipped) completely; the other ones asked for so
+        // far go back to the opener if the batch fails
+        std::unique_ptr<bool[]> finished(new bool[last - first]());
+        size_t requested = 0;
+        auto abandonBatch = [&]() {
+            closeBatch();
+            if (!discard) return;
+            for (size_t k = 0; k < requested; ++k) {
+                if (!finished[k]) discard(outPaths[first + k]);
+            }
+        };
+        for (size_t i = first; i < last; ++i) {
+            fds[i - first] = open(outPaths[i]);
+            requested = i - first + 1;
+            if (fds[i - first] < 0) {
+                abandonBatch();
+                throw std::runtime_error("Cannot open output: " + outPaths[i]);
+            }
+        }
+
+        std::atomic<size_t> nextIndex{first};
+        std::atomic<bool> stop{false};
+        std::atomic<size_t> batchSkipped{0};
+        try {
+            runParallel((unsigned)std::min<size_t>(workers, last - first), [&](unsigned) {
+                try {
+                    std::ifstream localIn(archivePath, std::ios::binary);
+                    if (!localIn) throw std::runtime_error("Cannot open archive worker stream");
+
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        throwIfCancelled();
+
+                        size_t i = nextIndex.fetch_add(1);
+                        if (i >= last) break;
+
+                        const auto &e = entries[i];
+                        int& fd = fds[i - first];
+                        localIn.clear();
+
+                        if (resume && (e.flags & KP_ENTRY_HAS_CHECKSUM)) {
+                            localIn.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
+                            if (!localIn.good()) throw std::runtime_error("Failed to seek to payload");
+                            if (fdMatchesPayload(localIn, fd, e.checksum, layoutOf(e))) {
+                                finished[i - first] = true;
+                                batchSkipped.fetch_add(1, std::memory_order_relaxed);
+                                native_progress_add_processed(e.dataSize);
+                                continue;
+                            }
+                            localIn.clear();
+                        }
+
+                        localIn.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
+                        if (!localIn.good()) throw std::runtime_error("Failed to seek to payload");
+
+                        // decompressToFd() closes the fd
+                        const int owned = fd;
+                        fd = -1;
+                        decompressToFd(localIn, e.dataSize, owned, layoutOf(e));
+                        finished[i - first] = true;
+                        native_progress_add_processed(e.dataSize);
+                    }
+                } catch (...) {
+                    stop.store(true);
+                    throw;
+                }
+            });
+        } catch (...) {
+            abandonBatch();
+            throw;
+        }
+        closeBatch();
+        skipped += batchSkipped.load();
+        first = last;
+    }
+
+    if (resume) KP_LOGI("Resume: %zu of %zu entries already extracted", skipped, entries.size());
+    return finalRootName;
+}
+
+std::vector<std::string> verifyArchive(const std::string& archivePath) {
+    std::vector<ArchiveEntry> entries = listArchive(archivePath);
 
+    uint64_t totalCompressed = 0;
+    for (const auto &e : entries) totalCompressed += e.dataSize;
+    native_progress_reset();
+    native_progress_set_total(totalCompressed);
+
+    // Verification is pure CPU (nothing is written), so use every core the
+    // memory budget allows.
+    const unsigned workers = std::max(1u, std::min<unsigned>(
+            verifyWorkersFor(largestDecoderSize(archivePath, entries)), (unsigned)entries.size()));
+    std::atomic<size_t> nextIndex{0};
+    std::vector<uint8_t> bad(entries.size(), 0);
+
+    // every worker polls the same token, so all of them unwind on cancel
+    runParallel(workers, [&](unsigned) {
+        std::ifstream localIn(archivePath, std::ios::binary);
+        if (!localIn) throw std::runtime_error("Cannot open archive worker stream");
+
+        while (true) {
+            size_t i = nextIndex.fetch_add(1);
+            if (i >= entries.size()) break;
+
+            const auto &e = entries[i];
+            try {
+                localIn.clear();
                 localIn.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
                 if (!localIn.good()) throw std::runtime_error("Failed to seek to payload");
 
-                decompressFromStream(localIn, e.dataSize, outPaths[i]);
-                native_progress_add_processed(e.dataSize);
+                uint64_t hash = hashFromStream(localIn, e.dataSize, layoutOf(e));
+                if ((e.flags & KP_ENTRY_HAS_CHECKSUM) && hash != e.checksum) bad[i] = 1;
+            } catch (const OperationCancelled&) {
+                throw;
+            } catch (const std::exception&) {
+                bad[i] = 1;
             }
-        }));
+            native_progress_add_processed(e.dataSize);
+        }
+    });
+
+    std::vector<std::string> corrupt;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (bad[i]) corrupt.push_back(entries[i].rel);
     }
+    return corrupt;
+}
 
-    for (auto &t : tasks) t.get();
+// Index of the archive previewed last. A preview opens one entry after another
+// (openEntryNative, readEntryNative), and each would otherwise parse every entry
+// header again. Keyed by the file's identity and mtime as well as its path, so an
+// archive rewritten in place is parsed anew.
+static std::shared_ptr<const std::vector<ArchiveEntry>> cachedIndex(std::istream& in,
+                                                                    const std::string& archivePath) {
+    struct CachedIndex {
+        std::string path;
+        struct stat st;
+        std::shared_ptr<const std::vector<ArchiveEntry>> entries;
+    };
+    static std::mutex mutex;
+    static CachedIndex cache;
 
-    in.close();
-    return finalRootName; // return root folder name
+    struct stat st;
+    if (::stat(archivePath.c_str(), &st) != 0) throw std::runtime_error("Cannot open archive");
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cache.entries && cache.path == archivePath && cache.st.st_dev == st.st_dev &&
+            cache.st.st_ino == st.st_ino && cache.st.st_size == st.st_size &&
+            cache.st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+            cache.st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+            return cache.entries;
+        }
+    }
+
+    auto entries = std::make_shared<const std::vector<ArchiveEntry>>(readArchiveIndex(in));
+    std::lock_guard<std::mutex> lock(mutex);
+    cache = CachedIndex{archivePath, st, entries};
+    return entries;
+}
+
+EntryReader::EntryReader(const std::string& archivePath, uint32_t index)
+        : in_(archivePath, std::ios::binary) {
+    if (!in_) throw std::runtime_error("Cannot open archive");
+
+    const auto entries = cachedIndex(in_, archivePath);
+    if (index >= entries->size()) throw std::runtime_error("Entry index out of range");
+
+    const auto &e = (*entries)[index];
+    in_.clear();
+    in_.seekg((std::streamoff)e.payloadOffset, std::ios::beg);
+    if (!in_.good()) throw std::runtime_error("Failed to seek to payload");
+
+    payload_.reset(new PayloadReader(in_, layoutOf(e)));
+}
+
+uint64_t extractEntryToMemory(const std::string& archivePath, uint32_t index,
+                              uint64_t offset, char* dst, uint64_t capacity) {
+    EntryReader reader(archivePath, index);
+    reader.skip(offset);
+    return reader.read(dst, capacity);
 }
@@ -2,15 +2,116 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <functional>
+#include <fstream>
+#include <memory>
 #include "progress.h"
+#include "compress.h"
 
 struct ArchiveInput {
-    std::string absPath;  // actual disk path
+    std::string absPath;  // actual disk path; for an InputOpener, its handle (may be empty)
     std::string relPath;  // path inside archive
     std::string ext;      // stored extension (without leading dot), may be empty
+    uint64_t size;        // file size captured during the scan
 };
 
+// One entry as recorded in the archive header table.
+struct ArchiveEntry {
+    std::string rel;        // path inside archive
+    std::string ext;        // stored extension (may be empty)
+    uint8_t flags;
+    uint64_t origSize;
+    uint64_t dataSize;      // size of KP05 payload in archive
+    uint64_t payloadOffset; // file offset where KP05 payload begins
+    uint64_t checksum;      // XXH64 of content, valid if flags & KP_ENTRY_HAS_CHECKSUM
+    bool compactPayload;    // v6 archive: payload in the compact layout (see PayloadLayout)
+};
+
+// Long jobs leave a checkpoint next to the archive ("<archive>.kpck") so a run
+// killed with the process can be continued with resumeArchive(). A run that
+// fails or is cancelled removes both the archive and the checkpoint.
 void createArchive(const std::vector<std::string>& inputs,
-                   const std::string& outputArchive);
+                   const std::string& outputArchive,
+                   const CompressOptions& opts = CompressOptions());
+
+// Opens one input for the createArchive() overload below, by the absPath the
+// caller gave it, and returns a readable fd (the archive code closes it), or -1
+// if it can't.
+using InputOpener = std::function<int(const ArchiveInput& input)>;
+
+// Archives inputs that have no usable path (Android SAF documents): files lists
+// them in archive order with relPath and size filled in (ext is ignored, it
+// follows from relPath); each is read through 'open'. absPath is the caller's
+// handle to the input (a document URI). When every input has one, a checkpoint
+// is written as for paths and resumeArchive() reopens the rest through an
+// opener given there; otherwise there is none.
+void createArchive(const std::vector<ArchiveInput>& files, const InputOpener& open,
+                   const std::string& outputArchive,
+                   const CompressOptions& opts = CompressOptions());
+
+// True if outputArchive has a usable checkpoint.
+bool canResumeArchive(const std::string& outputArchive);
+
+// Cuts outputArchive back to its last checkpoint and compresses the remaining
+// entries with the settings of the original run. Archives of opener inputs need
+// 'open' to reopen them by their handles; path archives ignore it.
+void resumeArchive(const std::string& outputArchive, const InputOpener& open = InputOpener());
+
+// Extracts every entry below outputFolder and returns the name of the root it
+// created there. With resume set, entries whose output is already present with
+// the right size and stored checksum are skipped (only they are read, not
+// decoded), and a failed run leaves the finished entries in place.
+std::string extractArchive(const std::string& archivePath, const std::string& outputFolder,
+                           bool resume = false);
+
+// Opens the output of one entry for the extractArchive() overload below. 'path' is
+// relative to the output folder and uses '/'; it is the root returned by
+// extractArchive() for single-entry archives and the entry's path below that root
+// otherwise. Returns a writable fd (readable too for resume; the archive code
+// closes it), or -1 if it can't. Called on the extracting thread only.
+using OutputOpener = std::function<int(const std::string& path)>;
 
-std::string extractArchive(const std::string& archivePath, const std::string& outputFolder);
+// Gets back, when an extraction fails or is cancelled, each output 'open' returned
+// that was not finished (not written, or only partly), so the opener can remove
+// what it created for it. Called on the extracting thread only.
+using OutputDiscarder = std::function<void(const std::string& path)>;
+
+// Same, writing every entry through 'open' (Android SAF destinations), so the
+// data is written once, at its final location. Outputs are opened in batches
+// and decoded into on all workers. Finished outputs are kept on failure; the
+// unfinished ones of the failing batch are handed to 'discard'.
+std::string extractArchive(const std::string& archivePath, const OutputOpener& open,
+                           bool resume = false,
+                           const OutputDiscarder& discard = OutputDiscarder());
+
+// Reads only the entry headers (no decompression) so contents can be browsed.
+std::vector<ArchiveEntry> listArchive(const std::string& archivePath);
+
+// Decodes every entry on all cores into a null sink and checks it against the
+// stored checksum. Returns the paths of entries that are corrupt (empty = OK).
+std::vector<std::string> verifyArchive(const std::string& archivePath);
+
+// Decodes one entry (by its listArchive() index) into caller-owned memory for
+// previews. Skips 'offset' decoded bytes, fills at most 'capacity' bytes and
+// returns how many were written. Nothing touches storage besides the archive.
+// Every call decodes from the start of the entry; use an EntryReader to stream one.
+uint64_t extractEntryToMemory(const std::string& archivePath, uint32_t index,
+                              uint64_t offset, char* dst, uint64_t capacity);
+
+// One entry (by its listArchive() index) read front to back in pieces, for previews
+// that stream an entry through a small buffer: each read() continues where the last
+// one stopped, so the entry is decoded once. Not for concurrent use.
+class EntryReader {
+public:
+    EntryReader(const std::string& archivePath, uint32_t index);
+
+    uint64_t size() const { return payload_->size(); }
+    uint64_t position() const { return payload_->position(); }
+    uint64_t read(char* dst, uint64_t capacity) { return payload_->read(dst, capacity); }
+    void skip(uint64_t n) { payload_->skip(n); }
+
+private:
+    std::ifstream in_;
+    std::unique_ptr<PayloadReader> payload_;
+};
@@ -0,0 +1,127 @@
+// budget.cpp
+#include "budget.h"
+#include "kitty.h"
+
+#define ZSTD_STATIC_LINKING_ONLY // ZSTD_estimate*
+#include <zstd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+static std::atomic<uint64_t> gBudget{0};
+
+static std::mutex gLimitsMutex;
+static bool gLimitsValid = false;
+static EngineLimits gLimits;
+
+static const uint64_t MiB = 1024ull * 1024ull;
+
+static uint64_t autoBudget() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || pageSize <= 0) return 256 * MiB;
+    uint64_t ram = (uint64_t)pages * (uint64_t)pageSize;
+    return std::min<uint64_t>(std::max<uint64_t>(ram / 8, 64 * MiB), 1024 * MiB);
+}
+
+void setMemoryBudget(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(gLimitsMutex);
+    gBudget.store(bytes);
+    gLimitsValid = false;
+}
+
+uint64_t memoryBudget() {
+    uint64_t b = gBudget.load();
+    return b ? b : autoBudget();
+}
+
+// Compression: every zstd worker owns a context plus in/out job buffers (1 MiB jobs).
+static unsigned zstdWorkersWithin(uint64_t budget, int level) {
+    const uint64_t perZstdWorker = ZSTD_estimateCStreamSize(level) + 2 * MiB;
+    const uint64_t zstdByBudget = (budget / 2) / perZstdWorker;
+    return (unsigned)std::min<uint64_t>(maxZstdWorkers(), zstdByBudget);
+}
+
+static uint64_t defaultDecoderSize() {
+    return ZSTD_estimateDStreamSize((size_t)defaultWindowSize());
+}
+
+// Extraction: each worker holds a decoder, its read/decode buffers and the
+// output staging buffer. Verification needs no staging buffer.
+static unsigned extractWorkersWithin(uint64_t budget, const EngineLimits& l, uint64_t decoderSize) {
+    const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    const uint64_t perWorker = decoderSize + 2 * l.chunkSize + l.writeBufferSize;
+    const uint64_t byBudget = std::max<uint64_t>(1, (budget / 2) / perWorker);
+    return (unsigned)std::min<uint64_t>({byBudget, 4ull, (uint64_t)hw});
+}
+
+static unsigned verifyWorkersWithin(uint64_t budget, const EngineLimits& l, uint64_t decoderSize) {
+    const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    const uint64_t perWorker = decoderSize + 2 * l.chunkSize;
+    return (unsigned)std::min<uint64_t>(std::max<uint64_t>(1, (budget / 2) / perWorker), hw);
+}
+
+static EngineLimits computeLimits(uint64_t budget) {
+    EngineLimits l;
+
+    // Smaller I/O buffers only when memory is really tight; 256 KiB otherwise.
+    l.chunkSize = budget < 32 * MiB ? 64 * 1024 : 256 * 1024;
+    l.writeBufferSize = budget < 32 * MiB ? 256 * 1024 : 1024 * 1024;
+
+    // Largest window (2^windowLog) that fits in an eighth of the budget.
+    int windowLog = 20;
+    while (windowLog < 27 && (2ull << windowLog) <= budget / 8) ++windowLog;
+    l.maxWindowLog = windowLog;
+
+    // decoders sized for the default window; see extractWorkersFor() for others
+    l.extractWorkers = extractWorkersWithin(budget, l, defaultDecoderSize());
+    l.verifyWorkers = verifyWorkersWithin(budget, l, defaultDecoderSize());
+
+    l.zstdWorkers = zstdWorkersWithin(budget, KP_DEFAULT_LEVEL);
+
+    // Idle contexts stay allocated between calls: keep the ones a default-level
+    // entry needs (with its zstd workers) or a default-window decoder, no bigger.
+    const uint64_t defaultCCtx = (uint64_t)(l.zstdWorkers + 1)
+                                 * (ZSTD_estimateCStreamSize(KP_DEFAULT_LEVEL) + 2 * MiB);
+    const uint64_t defaultDCtx = defaultDecoderSize();
+    l.pooledContextSize = (size_t)std::max(defaultCCtx, defaultDCtx);
+
+    return l;
+}
+
+unsigned maxZstdWorkers() {
+    const unsigned hw = std::thread::hardware_concurrency();
+    return hw <= 1 ? 0u : std::min(2u, hw - 1);
+}
+
+unsigned zstdWorkersForLevel(int level) {
+    if (level == KP_DEFAULT_LEVEL) return engineLimits().zstdWorkers;
+    return zstdWorkersWithin(memoryBudget(), level);
+}
+
+uint64_t defaultWindowSize() {
+    return (uint64_t)1 << ZSTD_getCParams(KP_DEFAULT_LEVEL, 0, 0).windowLog;
+}
+
+unsigned extractWorkersFor(uint64_t decoderSize) {
+    const EngineLimits l = engineLimits();
+    if (decoderSize <= defaultDecoderSize()) return l.extractWorkers;
+    return extractWorkersWithin(memoryBudget(), l, decoderSize);
+}
+
+unsigned verifyWorkersFor(uint64_t decoderSize) {
+    const EngineLimits l = engineLimits();
+    if (decoderSize <= defaultDecoderSize()) return l.verifyWorkers;
+    return verifyWorkersWithin(memoryBudget(), l, decoderSize);
+}
+
+EngineLimits engineLimits() {
+    std::lock_guard<std::mutex> lock(gLimitsMutex);
+    if (!gLimitsValid) {
+        gLimits = computeLimits(memoryBudget());
+        gLimitsValid = true;
+    }
+    return gLimits;
+}
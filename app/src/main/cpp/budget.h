@@ -0,0 +1,40 @@
+// budget.h
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Global memory budget for compression / extraction. 0 (default) = automatic:
+// an eighth of physical RAM, clamped to [64 MiB, 1 GiB].
+void setMemoryBudget(uint64_t bytes);
+uint64_t memoryBudget();
+
+// What the engine may use under the current budget.
+struct EngineLimits {
+    size_t chunkSize;         // read/decode buffer size in the streaming loops
+    size_t writeBufferSize;   // staging buffer of extraction outputs
+    unsigned extractWorkers;  // concurrent extraction workers
+    unsigned verifyWorkers;   // decode-only workers (no output), up to one per core
+    unsigned zstdWorkers;     // ZSTD_c_nbWorkers for compression (0 = single-threaded)
+    int maxWindowLog;         // cap on the compression window
+    size_t pooledContextSize; // largest zstd context kept idle for reuse
+};
+
+// Upper bound of EngineLimits::zstdWorkers whatever the budget; sizes the
+// shared zstd thread pool.
+unsigned maxZstdWorkers();
+
+// ZSTD_c_nbWorkers that fit the budget at 'level' (EngineLimits::zstdWorkers is
+// this for KP_DEFAULT_LEVEL). Stronger levels need far bigger contexts.
+unsigned zstdWorkersForLevel(int level);
+
+// Derived from memoryBudget() and the core count; cheap after the first call.
+EngineLimits engineLimits();
+
+// Window of KP_DEFAULT_LEVEL frames. EngineLimits::extractWorkers and verifyWorkers
+// assume decoders for it; a payload no larger than it can't need a bigger one.
+uint64_t defaultWindowSize();
+
+// extractWorkers / verifyWorkers for decoders of 'decoderSize' bytes (the largest
+// one an archive needs, e.g. for long-distance entries); 0 = the default decoder.
+unsigned extractWorkersFor(uint64_t decoderSize);
+unsigned verifyWorkersFor(uint64_t decoderSize);
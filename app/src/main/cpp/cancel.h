@@ -0,0 +1,44 @@
+// cancel.h
+#pragma once
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+// Thrown from the hot loops once the app asked to abandon the current job.
+struct OperationCancelled : std::runtime_error {
+    OperationCancelled() : std::runtime_error("Operation cancelled") {}
+};
+
+// Cancellation flag of one operation. The JNI layer keeps one per cancel token
+// the app passes in and binds it to the thread running that call (CancelScope);
+// runParallel() binds it on the pool threads working for the call as well. So a
+// job only ever sees its own cancel, and a job without a token can't be cancelled.
+using CancelFlag = std::shared_ptr<std::atomic<bool>>;
+
+// Flag bound to the calling thread, null if none is.
+inline CancelFlag& boundCancelFlag() {
+    static thread_local CancelFlag flag;
+    return flag;
+}
+
+// Binds 'flag' to the calling thread while in scope.
+class CancelScope {
+public:
+    explicit CancelScope(CancelFlag flag) : previous_(std::move(boundCancelFlag())) {
+        boundCancelFlag() = std::move(flag);
+    }
+
+    ~CancelScope() { boundCancelFlag() = std::move(previous_); }
+
+    CancelScope(const CancelScope&) = delete;
+    CancelScope& operator=(const CancelScope&) = delete;
+
+private:
+    CancelFlag previous_;
+};
+
+// Cheap enough to call once per chunk / per entry.
+inline void throwIfCancelled() {
+    const CancelFlag& flag = boundCancelFlag();
+    if (flag && flag->load(std::memory_order_relaxed)) throw OperationCancelled();
+}
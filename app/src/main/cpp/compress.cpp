@@ -3,36 +3,284 @@
 #include "kitty.h"
 #include "progress.h"
 #include "kp_log.h"
+#include "cancel.h"
+#include "budget.h"
+#include "varint.h"
 
+#define ZSTD_STATIC_LINKING_ONLY // ZSTD_getCParams, ZSTD_threadPool
 #include <zstd.h>
+#define XXH_STATIC_LINKING_ONLY
+#include "common/xxhash.h"
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <filesystem>
 #include <cstdint>
+#include <climits>
 #include <stdexcept>
 #include <algorithm>
 #include <cstring>
 #include <thread>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 using namespace std;
 namespace fs = std::filesystem;
 
 enum KPCodec : uint8_t {
-    KP_CODEC_ZSTD = 1
+    KP_CODEC_ZSTD = 1,
+    KP_CODEC_ZSTD_LONG = 2  // long-distance matching; u8 windowLog follows the codec byte
 };
 
-static void configureZstdWorkers(ZSTD_CStream* cs) {
-    unsigned hw = std::thread::hardware_concurrency();
-    if (hw <= 1) return;
+// Largest window a payload may ask the decoder for (1 GiB). Our own encoder
+// stays at or below 27; anything above is a damaged or hostile header.
+static const int KP_MAX_WINDOW_LOG = 30;
+
+// Value of the payload's isCompressed byte
+enum KPPayloadKind : uint8_t {
+    KP_PAYLOAD_STORED = 0,
+    KP_PAYLOAD_COMPRESSED = 1,
+    KP_PAYLOAD_SPARSE = 2  // compressed; u64 extentCount + (offset, length) pairs follow origSize
+};
+
+// One data region of a sparse file; everything between extents is a hole.
+struct Extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Starts the XXH64 (seed 0) an entry's checksum is taken with. Sparse payloads
+// hash their extent table first (u64 count, then u64 offset and length of each,
+// as in the KP05 header) and then the data extents, so data that would land at
+// the wrong offsets doesn't match either.
+static void beginContentHash(XXH64_state_t &state, const vector<Extent> &extents) {
+    XXH64_reset(&state, 0);
+    if (extents.empty()) return;
+    const uint64_t count = extents.size();
+    XXH64_update(&state, &count, sizeof(count));
+    for (const auto &e : extents) {
+        XXH64_update(&state, &e.offset, sizeof(e.offset));
+        XXH64_update(&state, &e.length, sizeof(e.length));
+    }
+}
+
+// Receives decoded bytes of a payload, in order. Returning false stops decoding early.
+using PayloadSink = function<bool(const char*, size_t)>;
+
+// Fixed part of a KP05 payload, everything before the data bytes.
+struct PayloadHeader {
+    bool isCompressed = false;
+    string ext;
+    uint64_t origSize = 0;
+    uint64_t dataSize = 0;  // compSize (compressed) or rawSize (stored)
+    vector<Extent> extents; // non-empty for sparse payloads
+    int windowLog = 0;      // KP_CODEC_ZSTD_LONG only, 0 = zstd default limit
+};
+
+// One zstd thread pool for every multithreaded context, instead of each
+// context starting (and keeping) threads of its own.
+static ZSTD_threadPool* sharedZstdPool() {
+    static ZSTD_threadPool* pool = ZSTD_createThreadPool(std::max(1u, maxZstdWorkers()));
+    return pool;
+}
+
+// Window of a long-distance payload: as large as the budget allows, but no
+// larger than the input needs.
+static int longWindowLog(uint64_t srcSize) {
+    int windowLog = ZSTD_WINDOWLOG_MIN;
+    while (windowLog < engineLimits().maxWindowLog && ((uint64_t)1 << windowLog) < srcSize) {
+        ++windowLog;
+    }
+    return windowLog;
+}
+
+// Worker count and window follow the memory budget (see budget.h).
+// windowLog != 0 turns on long-distance matching with that window.
+static void configureZstdWorkers(ZSTD_CStream* cs, int level, uint64_t srcSize, int windowLog) {
+    const EngineLimits limits = engineLimits();
+
+    if (windowLog) {
+        (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_enableLongDistanceMatching, 1);
+        (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_windowLog, windowLog);
+    } else {
+        // only shrink the window; small inputs already get a small one
+        const ZSTD_compressionParameters cp = ZSTD_getCParams(level, srcSize, 0);
+        if ((int)cp.windowLog > limits.maxWindowLog) {
+            (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_windowLog, limits.maxWindowLog);
+        }
+    }
+
+    const unsigned workers = zstdWorkersForLevel(level);
+    if (workers == 0) return;
 
-    unsigned workers = std::min(2u, hw - 1);
     size_t setWorkers = ZSTD_CCtx_setParameter(cs, ZSTD_c_nbWorkers, (int)workers);
     if (ZSTD_isError(setWorkers)) return; // not supported on this build, continue safely
 
+    if (ZSTD_threadPool* pool = sharedZstdPool()) (void)ZSTD_CCtx_refThreadPool(cs, pool);
+
     (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_jobSize, 1 << 20);
 }
 
+// Small pool of one-shot zstd contexts so in-memory calls reuse their workspace
+// instead of allocating a fresh context (several hundred KiB) per blob. Only
+// contexts up to EngineLimits::pooledContextSize are kept: the ones that grew
+// for a strong level, a long window or many zstd workers are freed on release.
+template <typename Ctx, Ctx* (*Create)(), size_t (*Free)(Ctx*), size_t (*SizeOf)(const Ctx*)>
+class ZstdContextPool {
+public:
+    ZstdContextPool() = default;
+    ZstdContextPool(const ZstdContextPool&) = delete;
+    ZstdContextPool& operator=(const ZstdContextPool&) = delete;
+
+    ~ZstdContextPool() {
+        for (Ctx *ctx : idle_) Free(ctx);
+    }
+
+    class Lease {
+    public:
+        Lease(ZstdContextPool &pool, Ctx *ctx) : pool_(pool), ctx_(ctx) {}
+        ~Lease() { pool_.release(ctx_); }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Ctx* get() const { return ctx_; }
+    private:
+        ZstdContextPool &pool_;
+        Ctx *ctx_;
+    };
+
+    Lease acquire() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!idle_.empty()) {
+                Ctx *ctx = idle_.back();
+                idle_.pop_back();
+                return Lease(*this, ctx);
+            }
+        }
+        Ctx *ctx = Create();
+        if (!ctx) throw runtime_error("Cannot allocate ZSTD context");
+        return Lease(*this, ctx);
+    }
+
+private:
+    // enough for every verify worker to find a warm context
+    static size_t maxIdle() {
+        return std::max<size_t>(4, std::thread::hardware_concurrency());
+    }
+
+    void release(Ctx *ctx) {
+        if (SizeOf(ctx) <= engineLimits().pooledContextSize) {
+            lock_guard<mutex> lock(mutex_);
+            if (idle_.size() < maxIdle()) {
+                idle_.push_back(ctx);
+                return;
+            }
+        }
+        Free(ctx);
+    }
+
+    mutex mutex_;
+    vector<Ctx*> idle_;
+};
+
+static ZstdContextPool<ZSTD_CCtx, ZSTD_createCCtx, ZSTD_freeCCtx, ZSTD_sizeof_CCtx> gCCtxPool;
+static ZstdContextPool<ZSTD_DCtx, ZSTD_createDCtx, ZSTD_freeDCtx, ZSTD_sizeof_DCtx> gDCtxPool;
+
+// Chunk buffer borrowed from a per-thread free list. Extraction and verify
+// workers stream one entry after another with the same chunk size, so after
+// the first entry every borrow is served from the list without allocating.
+class ScratchBuffer {
+public:
+    explicit ScratchBuffer(size_t size) : size_(size) {
+        auto &idle = idleList();
+        for (auto it = idle.begin(); it != idle.end(); ++it) {
+            if (it->size == size) {
+                buf_ = std::move(it->buf);
+                idle.erase(it);
+                return;
+            }
+        }
+        buf_.reset(new char[size]);
+    }
+
+    ~ScratchBuffer() {
+        auto &idle = idleList();
+        // sizes only change with the memory budget; drop the stalest on overflow
+        if (idle.size() >= MAX_IDLE) idle.erase(idle.begin());
+        idle.push_back({ size_, std::move(buf_) });
+    }
+
+    ScratchBuffer(const ScratchBuffer&) = delete;
+    ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+
+    char* data() const { return buf_.get(); }
+    size_t size() const { return size_; }
+
+private:
+    struct Idle {
+        size_t size;
+        unique_ptr<char[]> buf;
+    };
+
+    // in + out chunk for a codec loop plus a FileSink staging buffer
+    static const size_t MAX_IDLE = 3;
+
+    static vector<Idle>& idleList() {
+        static thread_local vector<Idle> idle;
+        return idle;
+    }
+
+    unique_ptr<char[]> buf_;
+    size_t size_;
+};
+
+// Readies a pooled context for a new frame. Parameters are reset as well as
+// the session: a context may come back from a call that set other ones.
+static void beginFrame(ZSTD_CCtx* cs, int level, uint64_t srcSize, int windowLog = 0) {
+    (void)ZSTD_CCtx_reset(cs, ZSTD_reset_session_and_parameters);
+    (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_compressionLevel, level);
+    configureZstdWorkers(cs, level, srcSize, windowLog);
+    // zstd frame checksum: lets the decoder catch corruption on its own
+    (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_checksumFlag, 1);
+    (void)ZSTD_CCtx_setPledgedSrcSize(cs, srcSize);
+}
+
+// Where pumpFrame() spent its time: in the encoder, and handing its output on.
+struct PumpTimes {
+    std::chrono::steady_clock::duration encode{};
+    std::chrono::steady_clock::duration write{};
+};
+
+// Feeds 'zin' to the encoder and writes what comes out. With ZSTD_e_end it
+// keeps going until the frame is complete; multithreaded contexts can hold
+// more than one output buffer's worth at that point. 'times', if given, gets
+// the time spent in each.
+static void pumpFrame(ZSTD_CCtx* cs, ostream &out, ScratchBuffer &outBuf,
+                      ZSTD_inBuffer &zin, ZSTD_EndDirective mode, PumpTimes *times = nullptr) {
+    using Clock = std::chrono::steady_clock;
+    while (true) {
+        ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
+        const Clock::time_point t0 = times ? Clock::now() : Clock::time_point();
+        const size_t ret = ZSTD_compressStream2(cs, &zout, &zin, mode);
+        const Clock::time_point t1 = times ? Clock::now() : t0;
+        if (ZSTD_isError(ret)) {
+            throw runtime_error(string("ZSTD compress error: ") + ZSTD_getErrorName(ret));
+        }
+        if (zout.pos) out.write(outBuf.data(), (streamsize)zout.pos);
+        if (times) {
+            times->encode += t1 - t0;
+            times->write += Clock::now() - t1;
+        }
+        if (mode == ZSTD_e_end ? ret == 0 : zin.pos == zin.size) return;
+    }
+}
+
 static string makeFinalOutputPath(const string &baseOut, const string &storedExt) {
     fs::path p(baseOut);
     if (!storedExt.empty() && p.extension().empty()) {
@@ -45,9 +293,6 @@ void storeRawFile(const string &inputPath, const string &outputPath) {
     ifstream in(inputPath, ios::binary);
     if (!in) throw runtime_error("Cannot open input file");
 
-    vector<char> buf((istreambuf_iterator<char>(in)), {});
-    in.close();
-
     ofstream out(outputPath, ios::binary);
     if (!out) throw runtime_error("Cannot open output file");
 
@@ -62,22 +307,36 @@ void storeRawFile(const string &inputPath, const string &outputPath) {
     out.write((char*)&extLen, sizeof(extLen));
     if (extLen) out.write(ext.data(), extLen);
 
-    uint64_t rawSize = buf.size();
+    // copy in chunks instead of holding the whole file in memory
+    uint64_t rawSize = (uint64_t)fs::file_size(inputPath);
     out.write((char*)&rawSize, sizeof(rawSize));
-    if (rawSize) out.write(buf.data(), rawSize);
+
+    ScratchBuffer buf(engineLimits().chunkSize);
+    while (in.good()) {
+        in.read(buf.data(), (streamsize)buf.size());
+        size_t got = (size_t)in.gcount();
+        if (!got) break;
+        out.write(buf.data(), (streamsize)got);
+    }
 }
 
 void restoreRawFile(ifstream &in, const string &outputPath) {
     uint64_t rawSize;
     in.read((char*)&rawSize, sizeof(rawSize));
 
-    vector<char> buf(rawSize);
-    if (rawSize) in.read(buf.data(), rawSize);
-
     ofstream out(outputPath, ios::binary);
     if (!out) throw runtime_error("Cannot open output file");
 
-    if (rawSize) out.write(buf.data(), rawSize);
+    ScratchBuffer buf(engineLimits().chunkSize);
+    uint64_t remaining = rawSize;
+    while (remaining > 0) {
+        const size_t toRead = (size_t)std::min<uint64_t>(remaining, (uint64_t)buf.size());
+        in.read(buf.data(), (streamsize)toRead);
+        const size_t got = (size_t)in.gcount();
+        if (got == 0) throw runtime_error("Failed to read stored data");
+        out.write(buf.data(), (streamsize)got);
+        remaining -= got;
+    }
 }
 
 void compressFile(const string &inputPath, const string &outputPath) {
@@ -110,13 +369,12 @@ void compressFile(const string &inputPath, const string &outputPath) {
     out.write((char*)&compSize, sizeof(compSize));
     streampos compStart = out.tellp();
 
-    ZSTD_CStream* cs = ZSTD_createCStream();
-    configureZstdWorkers(cs);
-    ZSTD_initCStream(cs, 1);
-    (void)ZSTD_CCtx_setPledgedSrcSize(cs, origSize);
+    auto lease = gCCtxPool.acquire();
+    ZSTD_CCtx* cs = lease.get();
+    beginFrame(cs, 1, origSize);
 
-    const size_t CHUNK = 256 * 1024;
-    vector<char> inBuf(CHUNK), outBuf(CHUNK);
+    const size_t CHUNK = engineLimits().chunkSize;
+    ScratchBuffer inBuf(CHUNK), outBuf(CHUNK);
 
     while (in.good()) {
         in.read(inBuf.data(), CHUNK);
@@ -124,17 +382,11 @@ void compressFile(const string &inputPath, const string &outputPath) {
         if (!got) break;
 
         ZSTD_inBuffer zin{ inBuf.data(), got, 0 };
-        while (zin.pos < zin.size) {
-            ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
-            ZSTD_compressStream(cs, &zout, &zin);
-            out.write(outBuf.data(), zout.pos);
-        }
+        pumpFrame(cs, out, outBuf, zin, ZSTD_e_continue);
     }
 
-    ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
-    ZSTD_endStream(cs, &zout);
-    out.write(outBuf.data(), zout.pos);
-    ZSTD_freeCStream(cs);
+    ZSTD_inBuffer zin{ nullptr, 0, 0 };
+    pumpFrame(cs, out, outBuf, zin, ZSTD_e_end);
 
     streampos end = out.tellp();
     compSize = (uint64_t)(end - compStart);
@@ -142,52 +394,169 @@ void compressFile(const string &inputPath, const string &outputPath) {
     out.write((char*)&compSize, sizeof(compSize));
 }
 
-// Stream-to-stream: used by archive to compress individual files
-void compressStreamToStream(istream &in, ostream &out, uint64_t origSize,
-                            const string &storedExt, uint64_t &outDataSize) {
-    outDataSize = 0;
-    streampos payloadStart = out.tellp();
+// Level range of CompressOptions::adaptiveLevel (stronger presets keep their
+// level as the ceiling).
+static const int KP_ADAPT_MIN_LEVEL = KP_FASTEST_LEVEL;
+static const int KP_ADAPT_MAX_LEVEL = 6;
+
+// Picks the level for the next zstd jobs from where the time went over the
+// last few MiB: blocked in the encoder (workers saturated, CPU bound) or
+// waiting on storage, reading input or writing output (storage bound). Small
+// steps with a dead band, so a noisy measurement doesn't make the level flap.
+class LevelAdapter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LevelAdapter(int level)
+            : level_(level), maxLevel_(std::max(KP_ADAPT_MAX_LEVEL, level)) {}
+
+    void addIo(Clock::duration d) { ioTime_ += d; }
+    void addEncode(Clock::duration d) { encodeTime_ += d; }
+
+    // Call after each chunk; returns true when the level should change.
+    bool update(size_t bytes, int &level) {
+        windowBytes_ += bytes;
+        if (windowBytes_ < WINDOW) return false;
+
+        const auto ioNs = std::chrono::duration_cast<std::chrono::nanoseconds>(ioTime_).count();
+        const auto encodeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(encodeTime_).count();
+        windowBytes_ = 0;
+        ioTime_ = encodeTime_ = Clock::duration::zero();
+
+        int next = level_;
+        if (encodeNs * 3 > ioNs * 4) {
+            next = std::max(KP_ADAPT_MIN_LEVEL, level_ - 1);
+        } else if (ioNs * 3 > encodeNs * 4) {
+            next = std::min(maxLevel_, level_ + 1);
+        }
+        if (next == 0) next = level_ < 0 ? 1 : -1; // 0 means "default" (3) to zstd
+        if (next == level_) return false;
 
-    // Write KP05 header for this entry
-    out.write(KITTY_MAGIC.data(), KITTY_MAGIC.size());
+        level_ = level = next;
+        return true;
+    }
+
+private:
+    static const size_t WINDOW = 8u << 20; // a few 1 MiB jobs per decision
 
-    uint8_t isCompressed = 1;
-    out.write(reinterpret_cast<char*>(&isCompressed), sizeof(uint8_t));
+    int level_;
+    const int maxLevel_;
+    size_t windowBytes_ = 0;
+    Clock::duration ioTime_{};
+    Clock::duration encodeTime_{};
+};
 
-    uint64_t extLen = storedExt.size();
-    out.write(reinterpret_cast<char*>(&extLen), sizeof(uint64_t));
-    if (extLen) out.write(storedExt.data(), extLen);
+// Pulls the next piece of input into buf; returns 0 at end of input.
+using ChunkReader = function<size_t(char*, size_t)>;
+
+// Writes one KP05 payload, or its compact v6 form with opts.compactPayload (the
+// archive entry then holds storedExt and the sizes). 'extents' is empty for
+// ordinary files; for sparse files it lists the data regions and 'read' yields
+// only their bytes, so the holes are neither read nor compressed.
+static void compressPayload(ostream &out, uint64_t origSize, const string &storedExt,
+                            const vector<Extent> &extents, const ChunkReader &read,
+                            uint64_t &outDataSize, uint64_t *outChecksum,
+                            const CompressOptions &opts) {
+    outDataSize = 0;
+    streampos payloadStart = out.tellp();
 
-    uint8_t codec = KP_CODEC_ZSTD;
-    out.write(reinterpret_cast<char*>(&codec), sizeof(uint8_t));
+    uint8_t isCompressed = extents.empty() ? KP_PAYLOAD_COMPRESSED : KP_PAYLOAD_SPARSE;
 
-    out.write(reinterpret_cast<char*>(&origSize), sizeof(uint64_t));
+    uint64_t dataBytes = origSize;
+    if (!extents.empty()) {
+        dataBytes = 0;
+        for (const auto &e : extents) dataBytes += e.length;
+    }
 
-    streampos compSizePos = out.tellp();
+    const uint8_t windowLog = opts.longDistance ? (uint8_t)longWindowLog(dataBytes) : 0;
+    uint8_t codec = windowLog ? KP_CODEC_ZSTD_LONG : KP_CODEC_ZSTD;
+
+    streampos compSizePos = -1;
     uint64_t compSize = 0;
-    out.write(reinterpret_cast<char*>(&compSize), sizeof(uint64_t));
+    if (opts.compactPayload) {
+        // v6 archive payload: kind, codec [, windowLog], sparse extents as varint
+        // (gap since the previous extent, length) pairs; the data runs to the end
+        out.write(reinterpret_cast<char*>(&isCompressed), sizeof(uint8_t));
+        out.write(reinterpret_cast<char*>(&codec), sizeof(uint8_t));
+        if (windowLog) out.write(reinterpret_cast<const char*>(&windowLog), sizeof(uint8_t));
+        if (!extents.empty()) {
+            writeVarint(out, extents.size());
+            uint64_t prevEnd = 0;
+            for (const auto &e : extents) {
+                writeVarint(out, e.offset - prevEnd);
+                writeVarint(out, e.length);
+                prevEnd = e.offset + e.length;
+            }
+        }
+    } else {
+        // Write KP05 header for this entry
+        out.write(KITTY_MAGIC.data(), KITTY_MAGIC.size());
+        out.write(reinterpret_cast<char*>(&isCompressed), sizeof(uint8_t));
+
+        uint64_t extLen = storedExt.size();
+        out.write(reinterpret_cast<char*>(&extLen), sizeof(uint64_t));
+        if (extLen) out.write(storedExt.data(), extLen);
+
+        out.write(reinterpret_cast<char*>(&codec), sizeof(uint8_t));
+        if (windowLog) out.write(reinterpret_cast<const char*>(&windowLog), sizeof(uint8_t));
+
+        out.write(reinterpret_cast<char*>(&origSize), sizeof(uint64_t));
+
+        if (!extents.empty()) {
+            uint64_t extentCount = extents.size();
+            out.write(reinterpret_cast<char*>(&extentCount), sizeof(uint64_t));
+            for (const auto &e : extents) {
+                out.write(reinterpret_cast<const char*>(&e.offset), sizeof(uint64_t));
+                out.write(reinterpret_cast<const char*>(&e.length), sizeof(uint64_t));
+            }
+        }
+
+        compSizePos = out.tellp();
+        out.write(reinterpret_cast<char*>(&compSize), sizeof(uint64_t));
+    }
     streampos compStart = out.tellp();
 
-    ZSTD_CStream* cs = ZSTD_createCStream();
-    configureZstdWorkers(cs);
-    ZSTD_initCStream(cs, -3);
-    (void)ZSTD_CCtx_setPledgedSrcSize(cs, origSize);
+    auto lease = gCCtxPool.acquire();
+    ZSTD_CCtx* cs = lease.get();
+    beginFrame(cs, opts.level, dataBytes, windowLog);
+
+    const size_t CHUNK = engineLimits().chunkSize;
+    ScratchBuffer inBuf(CHUNK), outBuf(CHUNK);
 
-    const size_t CHUNK = 256 * 1024;
-    vector<char> inBuf(CHUNK), outBuf(CHUNK);
+    XXH64_state_t hashState;
+    beginContentHash(hashState, extents);
 
     uint64_t progressBatch = 0;
 
-    while (in.good()) {
-        in.read(inBuf.data(), CHUNK);
-        size_t got = in.gcount();
+    // zstd applies a new level mid-frame only between worker jobs
+    int nbWorkers = 0;
+    (void)ZSTD_CCtx_getParameter(cs, ZSTD_c_nbWorkers, &nbWorkers);
+    const bool adapt = opts.adaptiveLevel && nbWorkers > 0;
+    LevelAdapter adapter(opts.level);
+
+    while (true) {
+        throwIfCancelled();
+
+        const auto t0 = LevelAdapter::Clock::now();
+        size_t got = read(inBuf.data(), CHUNK);
         if (!got) break;
+        const auto readTime = LevelAdapter::Clock::now() - t0;
+
+        // neither storage nor encoder; left out of both
+        XXH64_update(&hashState, inBuf.data(), got);
 
         ZSTD_inBuffer zin{ inBuf.data(), got, 0 };
-        while (zin.pos < zin.size) {
-            ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
-            ZSTD_compressStream(cs, &zout, &zin);
-            out.write(outBuf.data(), zout.pos);
+        PumpTimes times;
+        pumpFrame(cs, out, outBuf, zin, ZSTD_e_continue, adapt ? &times : nullptr);
+
+        if (adapt) {
+            adapter.addIo(readTime + times.write);
+            adapter.addEncode(times.encode);
+            int level;
+            if (adapter.update(got, level)) {
+                KP_LOGI("Adaptive level -> %d", level);
+                (void)ZSTD_CCtx_setParameter(cs, ZSTD_c_compressionLevel, level);
+            }
         }
 
         progressBatch += got;
@@ -197,38 +566,209 @@ void compressStreamToStream(istream &in, ostream &out, uint64_t origSize,
         }
     }
 
-    ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
-    ZSTD_endStream(cs, &zout);
-    out.write(outBuf.data(), zout.pos);
-    ZSTD_freeCStream(cs);
+    ZSTD_inBuffer zin{ nullptr, 0, 0 };
+    pumpFrame(cs, out, outBuf, zin, ZSTD_e_end);
 
+    // holes count as processed too, they just cost nothing
+    progressBatch += origSize - dataBytes;
     if (progressBatch) native_progress_add_processed(progressBatch);
 
     streampos end = out.tellp();
     compSize = (uint64_t)(end - compStart);
 
-    out.seekp(compSizePos);
-    out.write(reinterpret_cast<char*>(&compSize), sizeof(uint64_t));
-    out.seekp(end);
+    if (compSizePos != streampos(-1)) {
+        out.seekp(compSizePos);
+        out.write(reinterpret_cast<char*>(&compSize), sizeof(uint64_t));
+        out.seekp(end);
+    }
 
     outDataSize = (uint64_t)(end - payloadStart);
+    if (outChecksum) *outChecksum = XXH64_digest(&hashState);
 }
 
-void compressToStream(const string &inputPath, ostream &out, uint64_t &outDataSize) {
+// Stream-to-stream: used by archive to compress individual files
+void compressStreamToStream(istream &in, ostream &out, uint64_t origSize,
+                            const string &storedExt, uint64_t &outDataSize,
+                            uint64_t *outChecksum, const CompressOptions &opts) {
+    compressPayload(out, origSize, storedExt, {}, [&in](char *buf, size_t cap) -> size_t {
+        if (!in.good()) return 0;
+        in.read(buf, (streamsize)cap);
+        return (size_t)in.gcount();
+    }, outDataSize, outChecksum, opts);
+}
+
+// Data regions of a file with holes, via SEEK_DATA/SEEK_HOLE. Returns an empty
+// list for dense files and on filesystems that can't report holes.
+static vector<Extent> findDataExtents(int fd, uint64_t size) {
+    vector<Extent> extents;
+    const off_t end = (off_t)size;
+
+    // the probes move the file offset; dense files are then read sequentially
+    off_t firstHole = ::lseek(fd, 0, SEEK_HOLE);
+    ::lseek(fd, 0, SEEK_SET);
+    if (firstHole < 0 || firstHole >= end) return extents;
+
+    off_t pos = 0;
+    while (pos < end) {
+        off_t data = ::lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break; // only a hole left until EOF
+            return {};
+        }
+        if (data >= end) break;
+        off_t hole = ::lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) return {};
+        if (hole > end) hole = end;
+        extents.push_back({(uint64_t)data, (uint64_t)(hole - data)});
+        pos = hole;
+    }
+
+    // a completely empty (all-hole) file still needs one extent to be "sparse"
+    if (extents.empty()) extents.push_back({0, 0});
+    return extents;
+}
+
+static void compressFdPayload(int fd, const string &ext, uint64_t origSize, ostream &out,
+                              uint64_t &outDataSize, uint64_t *outChecksum,
+                              const CompressOptions &opts) {
     outDataSize = 0;
 
-    ifstream in(inputPath, ios::binary);
-    if (!in) throw runtime_error("Cannot open input");
+    const vector<Extent> extents = findDataExtents(fd, origSize);
+    size_t extentIdx = 0;
+    uint64_t extentPos = 0;
+
+    // dense files: sequential read(); sparse files: pread() only the data extents
+    ChunkReader read = [&](char *buf, size_t cap) -> size_t {
+        if (extents.empty()) {
+            while (true) {
+                ssize_t got = ::read(fd, buf, cap);
+                if (got < 0 && errno == EINTR) continue;
+                if (got < 0) throw runtime_error("Failed to read input");
+                return (size_t)got;
+            }
+        }
+        while (extentIdx < extents.size() && extentPos == extents[extentIdx].length) {
+            ++extentIdx;
+            extentPos = 0;
+        }
+        if (extentIdx == extents.size()) return 0;
+
+        const Extent &e = extents[extentIdx];
+        const size_t want = (size_t)std::min<uint64_t>(cap, e.length - extentPos);
+        ssize_t got;
+        do {
+            got = ::pread(fd, buf, want, (off_t)(e.offset + extentPos));
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) throw runtime_error("Failed to read input");
+        extentPos += (uint64_t)got;
+        return (size_t)got;
+    };
+
+    compressPayload(out, origSize, ext, extents, read, outDataSize, outChecksum, opts);
+}
+
+void compressToStream(const string &inputPath, uint64_t origSize, ostream &out,
+                      uint64_t &outDataSize, uint64_t *outChecksum,
+                      const CompressOptions &opts) {
+    const int fd = ::open(inputPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw runtime_error("Cannot open input");
 
     string ext = fs::path(inputPath).extension().string();
     if (!ext.empty() && ext[0] == '.') ext.erase(0, 1);
 
-    uint64_t origSize = fs::file_size(inputPath);
+    try {
+        compressFdPayload(fd, ext, origSize, out, outDataSize, outChecksum, opts);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+void compressToStream(int fd, uint64_t origSize, ostream &out, uint64_t &outDataSize,
+                      uint64_t *outChecksum, const CompressOptions &opts) {
+    compressFdPayload(fd, string(), origSize, out, outDataSize, outChecksum, opts);
+}
+
+void compressToStream(const string &inputPath, ostream &out, uint64_t &outDataSize,
+                      uint64_t *outChecksum, const CompressOptions &opts) {
+    compressToStream(inputPath, (uint64_t)fs::file_size(inputPath), out, outDataSize,
+                     outChecksum, opts);
+}
+
+// generous ZSTD_compressBound(); computed here since size_t is 32-bit on some ABIs
+static void checkCompressedSize(const PayloadHeader &h) {
+    const uint64_t maxDataSize = h.origSize + (h.origSize >> 7) + (1u << 20);
+    if (h.dataSize == 0 || h.dataSize > maxDataSize) {
+        throw runtime_error("Invalid compressed size: " + std::to_string(h.dataSize));
+    }
+}
+
+// v6 archive payload (see compressPayload); ext and sizes come from the entry.
+static PayloadHeader readCompactPayloadHeader(istream &in, const PayloadLayout &layout) {
+    PayloadHeader h;
+    h.ext = layout.ext;
+    h.origSize = layout.origSize;
+    uint64_t used = 0;
+
+    uint8_t kind = 0;
+    in.read(reinterpret_cast<char*>(&kind), sizeof(uint8_t));
+    ++used;
+    if (kind > KP_PAYLOAD_SPARSE) {
+        throw runtime_error("Unsupported payload kind: " + std::to_string(kind));
+    }
+    h.isCompressed = kind != KP_PAYLOAD_STORED;
+
+    if (h.isCompressed) {
+        uint8_t codec = 0;
+        in.read(reinterpret_cast<char*>(&codec), sizeof(uint8_t));
+        ++used;
+        if (codec == KP_CODEC_ZSTD_LONG) {
+            uint8_t windowLog = 0;
+            in.read(reinterpret_cast<char*>(&windowLog), sizeof(uint8_t));
+            ++used;
+            if (windowLog < ZSTD_WINDOWLOG_MIN || windowLog > KP_MAX_WINDOW_LOG) {
+                throw runtime_error("Invalid window: " + std::to_string(windowLog));
+            }
+            h.windowLog = windowLog;
+        } else if (codec != KP_CODEC_ZSTD) {
+            throw runtime_error("Unsupported codec: " + std::to_string(codec));
+        }
+    }
+
+    if (kind == KP_PAYLOAD_SPARSE) {
+        const uint64_t extentCount = readVarint(in, &used);
+        if (extentCount == 0 || extentCount > (1u << 24)) {
+            throw runtime_error("Invalid extent count: " + std::to_string(extentCount));
+        }
+        h.extents.resize((size_t)extentCount);
+        uint64_t prevEnd = 0;
+        for (auto &e : h.extents) {
+            const uint64_t gap = readVarint(in, &used);
+            e.length = readVarint(in, &used);
+            if (gap > h.origSize - prevEnd || e.length > h.origSize - prevEnd - gap) {
+                throw runtime_error("Invalid sparse extent");
+            }
+            e.offset = prevEnd + gap;
+            prevEnd = e.offset + e.length;
+        }
+    }
 
-    compressStreamToStream(in, out, origSize, ext, outDataSize);
+    if (!in.good()) throw runtime_error("Failed to read payload header");
+    if (used > layout.payloadSize) throw runtime_error("Invalid payload size");
+    h.dataSize = layout.payloadSize - used;
+
+    if (!h.isCompressed) {
+        if (h.dataSize != h.origSize) throw runtime_error("Invalid stored size");
+    } else {
+        checkCompressedSize(h);
+    }
+    return h;
 }
 
-void decompressFromStream(istream &in, uint64_t dataSize, const string &outputPath) {
+static PayloadHeader readPayloadHeader(istream &in, const PayloadLayout &layout = PayloadLayout()) {
+    if (layout.compact) return readCompactPayloadHeader(in, layout);
+
     string magic(4, '\0');
     in.read(magic.data(), 4);
 
@@ -236,8 +776,14 @@ void decompressFromStream(istream &in, uint64_t dataSize, const string &outputPa
         throw runtime_error("Bad KP05 magic");
     }
 
+    PayloadHeader h;
+
     uint8_t isCompressed;
     in.read(reinterpret_cast<char*>(&isCompressed), sizeof(uint8_t));
+    h.isCompressed = isCompressed != KP_PAYLOAD_STORED;
+    if (isCompressed > KP_PAYLOAD_SPARSE) {
+        throw runtime_error("Unsupported payload kind: " + std::to_string(isCompressed));
+    }
 
     uint64_t extLen;
     in.read(reinterpret_cast<char*>(&extLen), sizeof(uint64_t));
@@ -246,52 +792,96 @@ void decompressFromStream(istream &in, uint64_t dataSize, const string &outputPa
         throw runtime_error("Invalid extLen: " + std::to_string(extLen));
     }
 
-    string ext(extLen, '\0');
-    if (extLen) in.read(&ext[0], extLen);
+    h.ext.assign(extLen, '\0');
+    if (extLen) in.read(&h.ext[0], extLen);
 
-    if (!isCompressed) {
-        restoreRawFile((ifstream&)in, makeFinalOutputPath(outputPath, ext));
-        return;
+    if (!h.isCompressed) {
+        in.read(reinterpret_cast<char*>(&h.dataSize), sizeof(uint64_t));
+        h.origSize = h.dataSize;
+        if (!in.good()) throw runtime_error("Failed to read KP05 header");
+        return h;
     }
 
     uint8_t codec;
     in.read(reinterpret_cast<char*>(&codec), sizeof(uint8_t));
 
-    if (codec != KP_CODEC_ZSTD) {
+    if (codec == KP_CODEC_ZSTD_LONG) {
+        uint8_t windowLog = 0;
+        in.read(reinterpret_cast<char*>(&windowLog), sizeof(uint8_t));
+        if (windowLog < ZSTD_WINDOWLOG_MIN || windowLog > KP_MAX_WINDOW_LOG) {
+            throw runtime_error("Invalid window: " + std::to_string(windowLog));
+        }
+        h.windowLog = windowLog;
+    } else if (codec != KP_CODEC_ZSTD) {
         throw runtime_error("Unsupported codec: " + std::to_string(codec));
     }
 
-    uint64_t origSize;
-    in.read(reinterpret_cast<char*>(&origSize), sizeof(uint64_t));
+    in.read(reinterpret_cast<char*>(&h.origSize), sizeof(uint64_t));
+
+    if (isCompressed == KP_PAYLOAD_SPARSE) {
+        uint64_t extentCount = 0;
+        in.read(reinterpret_cast<char*>(&extentCount), sizeof(uint64_t));
+        if (!in.good() || extentCount == 0 || extentCount > (1u << 24)) {
+            throw runtime_error("Invalid extent count: " + std::to_string(extentCount));
+        }
+        h.extents.resize((size_t)extentCount);
+        uint64_t prevEnd = 0;
+        for (auto &e : h.extents) {
+            in.read(reinterpret_cast<char*>(&e.offset), sizeof(uint64_t));
+            in.read(reinterpret_cast<char*>(&e.length), sizeof(uint64_t));
+            if (e.offset < prevEnd || e.length > h.origSize || e.offset > h.origSize - e.length) {
+                throw runtime_error("Invalid sparse extent");
+            }
+            prevEnd = e.offset + e.length;
+        }
+    }
 
-    uint64_t compSize;
-    in.read(reinterpret_cast<char*>(&compSize), sizeof(uint64_t));
+    in.read(reinterpret_cast<char*>(&h.dataSize), sizeof(uint64_t));
 
     if (!in.good()) {
         throw runtime_error("Failed to read KP05 header");
     }
 
-    if (compSize == 0 || compSize > 2000000000ULL) {
-        throw runtime_error("Invalid compressed size: " + std::to_string(compSize));
-    }
+    checkCompressedSize(h);
+    return h;
+}
 
-    ofstream out(makeFinalOutputPath(outputPath, ext), ios::binary);
-    if (!out) throw runtime_error("Cannot open output");
+// Feeds the decoded bytes of the payload that follows 'h' into 'sink'.
+static void decodePayload(istream &in, const PayloadHeader &h, const PayloadSink &sink) {
+    const size_t CHUNK = engineLimits().chunkSize;
+    ScratchBuffer inBuf(CHUNK);
+
+    if (!h.isCompressed) {
+        uint64_t remaining = h.dataSize;
+        while (remaining > 0) {
+            throwIfCancelled();
+            const size_t toRead = (size_t)std::min<uint64_t>(remaining, (uint64_t)inBuf.size());
+            in.read(inBuf.data(), (streamsize)toRead);
+            const size_t got = (size_t)in.gcount();
+            if (got == 0) throw runtime_error("Failed to read stored data");
+            remaining -= got;
+            if (!sink(inBuf.data(), got)) return;
+        }
+        return;
+    }
 
-    ZSTD_DStream* ds = ZSTD_createDStream();
-    ZSTD_initDStream(ds);
+    auto lease = gDCtxPool.acquire();
+    ZSTD_DCtx* ds = lease.get();
+    (void)ZSTD_DCtx_reset(ds, ZSTD_reset_session_and_parameters);
+    // Long-distance payloads declare their window: allow exactly that much,
+    // above the default limit (2^27) if need be, and no more.
+    if (h.windowLog) (void)ZSTD_DCtx_setParameter(ds, ZSTD_d_windowLogMax, h.windowLog);
 
-    const size_t CHUNK = 256 * 1024;
-    vector<char> inBuf(CHUNK);
-    vector<char> outBuf(CHUNK);
+    ScratchBuffer outBuf(CHUNK);
 
-    uint64_t remaining = compSize;
+    uint64_t remaining = h.dataSize;
+    size_t ret = 1;
     while (remaining > 0) {
+        throwIfCancelled();
         const size_t toRead = (size_t)std::min<uint64_t>(remaining, (uint64_t)inBuf.size());
         in.read(inBuf.data(), (streamsize)toRead);
         const size_t got = (size_t)in.gcount();
         if (got == 0) {
-            ZSTD_freeDStream(ds);
             throw runtime_error("Failed to read compressed data");
         }
         remaining -= got;
@@ -299,14 +889,508 @@ void decompressFromStream(istream &in, uint64_t dataSize, const string &outputPa
         ZSTD_inBuffer zin{ inBuf.data(), got, 0 };
         while (zin.pos < zin.size) {
             ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
-            size_t ret = ZSTD_decompressStream(ds, &zout, &zin);
+            ret = ZSTD_decompressStream(ds, &zout, &zin);
             if (ZSTD_isError(ret)) {
-                ZSTD_freeDStream(ds);
-                throw runtime_error("ZSTD decompress error");
+                throw runtime_error(string("ZSTD decompress error: ") + ZSTD_getErrorName(ret));
+            }
+            if (zout.pos && !sink(outBuf.data(), zout.pos)) return;
+        }
+    }
+
+    // flush whatever is still buffered inside the decoder
+    while (ret != 0) {
+        ZSTD_inBuffer zin{ nullptr, 0, 0 };
+        ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
+        ret = ZSTD_decompressStream(ds, &zout, &zin);
+        if (ZSTD_isError(ret)) {
+            throw runtime_error(string("ZSTD decompress error: ") + ZSTD_getErrorName(ret));
+        }
+        if (zout.pos) {
+            if (!sink(outBuf.data(), zout.pos)) break;
+        } else if (ret != 0) {
+            throw runtime_error("Truncated ZSTD frame");
+        }
+    }
+}
+
+// Output file for extraction. The final size is known from the header, so the
+// file is preallocated up front (one extent allocation instead of growing it
+// 256 KiB at a time) and filled with large writes at aligned offsets
+// (EngineLimits::writeBufferSize, 1 MiB unless memory is tight).
+class FileSink {
+public:
+    // path is relative to dirFd (AT_FDCWD for plain paths). created, if given, tells
+    // whether the file is new or an existing one was replaced.
+    FileSink(int dirFd, const string &path, uint64_t expectedSize, bool sparse = false,
+             bool *created = nullptr)
+            : expected_(expectedSize), sparse_(sparse) {
+        fd_ = ::openat(dirFd, path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        const bool isNew = fd_ >= 0;
+        if (!isNew && errno == EEXIST) {
+            fd_ = ::openat(dirFd, path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+        }
+        if (fd_ < 0) throw runtime_error("Cannot open output");
+        if (created) *created = isNew;
+        init();
+    }
+
+    // Takes over an already open fd and replaces its content. Emptying it is best
+    // effort: fds of some document providers are pipes, which start empty anyway.
+    FileSink(int fd, uint64_t expectedSize, bool sparse)
+            : fd_(fd), expected_(expectedSize), sparse_(sparse) {
+        if (fd_ < 0) throw runtime_error("Cannot open output");
+        (void)::ftruncate(fd_, 0);
+        (void)::lseek(fd_, 0, SEEK_SET);
+        init();
+    }
+
+    ~FileSink() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    void write(const char *p, size_t n) {
+        // big pieces skip the staging copy when nothing is pending
+        if (used_ == 0 && n >= bufSize_) {
+            writeAll(p, n);
+            return;
+        }
+        while (n > 0) {
+            const size_t take = std::min(n, bufSize_ - used_);
+            memcpy(buf_->data() + used_, p, take);
+            used_ += take;
+            p += take;
+            n -= take;
+            if (used_ == bufSize_) flush();
+        }
+    }
+
+    // Continue writing at 'offset'; the skipped range stays a hole.
+    void seek(uint64_t offset) {
+        flush();
+        if (::lseek(fd_, (off_t)offset, SEEK_SET) < 0) throw runtime_error("Failed to seek output");
+        pos_ = offset;
+    }
+
+    void close() {
+        flush();
+        // preallocation set the size already; trim if the payload came up short.
+        // Sparse outputs are extended instead so a trailing hole is kept.
+        const uint64_t finalSize = sparse_ ? expected_ : pos_;
+        if (pos_ != expected_ && ::ftruncate(fd_, (off_t)finalSize) != 0) {
+            throw runtime_error("Cannot set output size");
+        }
+        const int fd = fd_;
+        fd_ = -1;
+        if (::close(fd) != 0) throw runtime_error("Failed to close output");
+    }
+
+private:
+    void init() {
+        // best effort: not every filesystem supports it (e.g. FAT on SD cards).
+        // Sparse outputs skip it, preallocating would fill in the holes.
+        if (expected_ > 0 && !sparse_) (void)::fallocate(fd_, 0, 0, (off_t)expected_);
+
+        buf_.reset(new ScratchBuffer(engineLimits().writeBufferSize));
+        bufSize_ = buf_->size();
+    }
+
+    void flush() {
+        if (used_) writeAll(buf_->data(), used_);
+        used_ = 0;
+    }
+
+    void writeAll(const char *p, size_t n) {
+        while (n > 0) {
+            ssize_t w = ::write(fd_, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Failed to write output");
             }
-            if (zout.pos) out.write(outBuf.data(), zout.pos);
+            p += w;
+            n -= (size_t)w;
+            pos_ += (uint64_t)w;
         }
     }
 
-    ZSTD_freeDStream(ds);
+    int fd_ = -1;
+    uint64_t expected_ = 0;
+    bool sparse_ = false;
+    uint64_t pos_ = 0;
+    unique_ptr<ScratchBuffer> buf_;
+    size_t bufSize_ = 0;
+    size_t used_ = 0;
+};
+
+// Decodes the payload described by h (read from 'in') into 'out' and closes it.
+static void writePayload(istream &in, const PayloadHeader &h, FileSink &out) {
+    if (h.extents.empty()) {
+        decodePayload(in, h, [&out](const char* p, size_t n) {
+            out.write(p, n);
+            return true;
+        });
+    } else {
+        // decoded bytes are the data extents back to back; place each one
+        // at its offset and skip over the holes
+        size_t idx = 0;
+        uint64_t inExtent = 0;
+        decodePayload(in, h, [&](const char* p, size_t n) {
+            while (n > 0) {
+                while (idx < h.extents.size() && inExtent == h.extents[idx].length) {
+                    ++idx;
+                    inExtent = 0;
+                }
+                if (idx == h.extents.size()) throw runtime_error("Sparse data overruns extents");
+                const Extent &e = h.extents[idx];
+                if (inExtent == 0) out.seek(e.offset);
+                const size_t take = (size_t)std::min<uint64_t>(n, e.length - inExtent);
+                out.write(p, take);
+                inExtent += take;
+                p += take;
+                n -= take;
+            }
+            return true;
+        });
+    }
+    out.close();
+}
+
+void decompressFromStream(istream &in, uint64_t dataSize, int dirFd, const string &outputPath,
+                          const PayloadLayout &layout, bool *created) {
+    PayloadHeader h = readPayloadHeader(in, layout);
+
+    const string finalPath = makeFinalOutputPath(outputPath, h.ext);
+
+    // nothing to clean up if the output can't be opened
+    FileSink out(dirFd, finalPath, h.origSize, !h.extents.empty(), created);
+    try {
+        writePayload(in, h, out);
+    } catch (...) {
+        // don't leave a truncated file behind (failure or cancellation)
+        ::unlinkat(dirFd, finalPath.c_str(), 0);
+        throw;
+    }
+}
+
+void decompressToFd(istream &in, uint64_t dataSize, int fd, const PayloadLayout &layout) {
+    PayloadHeader h;
+    try {
+        h = readPayloadHeader(in, layout);
+    } catch (...) {
+        if (fd >= 0) ::close(fd);
+        throw;
+    }
+    FileSink out(fd, h.origSize, !h.extents.empty());
+    writePayload(in, h, out);
+}
+
+void decompressFromStream(istream &in, uint64_t dataSize, const string &outputPath,
+                          const PayloadLayout &layout) {
+    decompressFromStream(in, dataSize, AT_FDCWD, outputPath, layout);
+}
+
+uint64_t payloadDecoderSize(istream &in, const PayloadLayout &layout) {
+    try {
+        const PayloadHeader h = readPayloadHeader(in, layout);
+        if (!h.isCompressed) return 0;
+
+        char frame[ZSTD_FRAMEHEADERSIZE_MAX];
+        in.read(frame, (streamsize)std::min<uint64_t>(sizeof(frame), h.dataSize));
+        const size_t size = ZSTD_estimateDStreamSize_fromFrame(frame, (size_t)in.gcount());
+        return ZSTD_isError(size) ? 0 : size;
+    } catch (const std::exception&) {
+        return 0;
+    }
+}
+
+uint64_t hashFromStream(istream &in, uint64_t dataSize, const PayloadLayout &layout) {
+    PayloadHeader h = readPayloadHeader(in, layout);
+
+    XXH64_state_t hashState;
+    beginContentHash(hashState, h.extents);
+    uint64_t produced = 0;
+
+    decodePayload(in, h, [&](const char* p, size_t n) {
+        XXH64_update(&hashState, p, n);
+        produced += n;
+        return true;
+    });
+
+    // sparse payloads decode to their data extents only
+    uint64_t expected = h.origSize;
+    if (!h.extents.empty()) {
+        expected = 0;
+        for (const auto &e : h.extents) expected += e.length;
+    }
+    if (produced != expected) {
+        throw runtime_error("Decoded size mismatch");
+    }
+    return XXH64_digest(&hashState);
+}
+
+// true if the file open at fd holds what the payload h decodes to (size and XXH64
+// over the same bytes the checksum was taken over); fd stays open.
+static bool fileMatchesPayload(int fd, const PayloadHeader &h, uint64_t checksum) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != h.origSize) {
+        return false;
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // whole file, or the data extents
+    vector<Extent> extents = h.extents;
+    if (extents.empty()) extents.push_back({0, h.origSize});
+
+    const size_t CHUNK = engineLimits().chunkSize;
+    ScratchBuffer buf(CHUNK);
+    XXH64_state_t hashState;
+    beginContentHash(hashState, h.extents);
+
+    for (const auto &e : extents) {
+        uint64_t pos = e.offset;
+        const uint64_t end = e.offset + e.length;
+        while (pos < end) {
+            throwIfCancelled();
+            const size_t want = (size_t)std::min<uint64_t>(CHUNK, end - pos);
+            ssize_t got = ::pread(fd, buf.data(), want, (off_t)pos);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                return false;
+            }
+            XXH64_update(&hashState, buf.data(), (size_t)got);
+            pos += (uint64_t)got;
+        }
+    }
+    return XXH64_digest(&hashState) == checksum;
+}
+
+bool outputMatchesPayload(istream &in, int dirFd, const string &outputPath, uint64_t checksum,
+                          const PayloadLayout &layout) {
+    PayloadHeader h = readPayloadHeader(in, layout);
+    const string finalPath = makeFinalOutputPath(outputPath, h.ext);
+
+    int fd = ::openat(dirFd, finalPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok;
+    try {
+        ok = fileMatchesPayload(fd, h, checksum);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool fdMatchesPayload(istream &in, int fd, uint64_t checksum, const PayloadLayout &layout) {
+    PayloadHeader h = readPayloadHeader(in, layout);
+    return fileMatchesPayload(fd, h, checksum);
+}
+
+bool outputMatchesPayload(istream &in, const string &outputPath, uint64_t checksum,
+                          const PayloadLayout &layout) {
+    return outputMatchesPayload(in, AT_FDCWD, outputPath, checksum, layout);
+}
+
+// Decoder state of a PayloadReader. Unlike decodePayload(), it stops after every
+// piece and picks up where it left off, so it owns its buffers and context.
+struct PayloadReader::State {
+    using DCtxLease = decltype(gDCtxPool)::Lease;
+
+    explicit State(istream &stream) : in(stream) {}
+
+    // Next bytes of the payload's data (the extents back to back for a sparse one)
+    // into dst, or dropped if dst is null. 0 once there are no more.
+    size_t pull(char *dst, size_t n) {
+        if (!h.isCompressed) {
+            n = (size_t)std::min<uint64_t>(std::min<uint64_t>(n, remaining), inBuf.size());
+            if (n == 0) return 0;
+            throwIfCancelled();
+            in.read(dst ? dst : inBuf.data(), (streamsize)n);
+            const size_t got = (size_t)in.gcount();
+            if (got == 0) throw runtime_error("Failed to read stored data");
+            remaining -= got;
+            return got;
+        }
+
+        while (outPos == outSize) {
+            if (zin.pos == zin.size && remaining > 0) {
+                throwIfCancelled();
+                const size_t toRead = (size_t)std::min<uint64_t>(remaining, (uint64_t)inBuf.size());
+                in.read(inBuf.data(), (streamsize)toRead);
+                const size_t got = (size_t)in.gcount();
+                if (got == 0) throw runtime_error("Failed to read compressed data");
+                remaining -= got;
+                zin = ZSTD_inBuffer{ inBuf.data(), got, 0 };
+            }
+
+            // without input left, this only flushes what the decoder still holds
+            const bool inputLeft = zin.pos < zin.size;
+            ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
+            const size_t ret = ZSTD_decompressStream(lease->get(), &zout, &zin);
+            if (ZSTD_isError(ret)) {
+                throw runtime_error(string("ZSTD decompress error: ") + ZSTD_getErrorName(ret));
+            }
+            outPos = 0;
+            outSize = zout.pos;
+            if (outSize == 0 && !inputLeft) {
+                if (ret != 0) throw runtime_error("Truncated ZSTD frame");
+                return 0;
+            }
+        }
+
+        const size_t take = std::min(n, outSize - outPos);
+        if (dst) memcpy(dst, outBuf.data() + outPos, take);
+        outPos += take;
+        return take;
+    }
+
+    // Moves n bytes on in the logical content, copying them to dst unless it is
+    // null; zeros for the holes of a sparse payload come without decoding.
+    uint64_t advance(char *dst, uint64_t n) {
+        uint64_t done = 0;
+        while (done < n && pos < h.origSize) {
+            uint64_t want = std::min(n - done, h.origSize - pos);
+            if (!h.extents.empty()) {
+                while (extent < h.extents.size() &&
+                       pos >= h.extents[extent].offset + h.extents[extent].length) {
+                    ++extent;
+                }
+                const uint64_t dataAt = extent < h.extents.size() ? h.extents[extent].offset : h.origSize;
+                if (pos < dataAt) {
+                    const uint64_t zeros = std::min(want, dataAt - pos);
+                    if (dst) memset(dst + done, 0, (size_t)zeros);
+                    done += zeros;
+                    pos += zeros;
+                    continue;
+                }
+                want = std::min(want, dataAt + h.extents[extent].length - pos);
+            }
+            const size_t got = pull(dst ? dst + done : nullptr,
+                                    (size_t)std::min<uint64_t>(want, SIZE_MAX));
+            if (got == 0) throw runtime_error("Decoded size mismatch");
+            done += got;
+            pos += got;
+        }
+        return done;
+    }
+
+    istream &in;
+    PayloadHeader h;
+    uint64_t pos = 0;       // in the logical content
+    size_t extent = 0;      // sparse: first extent that doesn't end at or before pos
+    uint64_t remaining = 0; // payload bytes not read from 'in' yet
+    unique_ptr<DCtxLease> lease;
+    vector<char> inBuf;
+    vector<char> outBuf;
+    ZSTD_inBuffer zin{ nullptr, 0, 0 };
+    size_t outPos = 0;      // decoded bytes in outBuf not handed out yet: [outPos, outSize)
+    size_t outSize = 0;
+};
+
+PayloadReader::PayloadReader(istream &in, const PayloadLayout &layout) : state_(new State(in)) {
+    State &s = *state_;
+    s.h = readPayloadHeader(in, layout);
+    s.remaining = s.h.dataSize;
+
+    const size_t CHUNK = engineLimits().chunkSize;
+    s.inBuf.resize(CHUNK);
+    if (!s.h.isCompressed) return;
+
+    s.lease.reset(new State::DCtxLease(gDCtxPool.acquire()));
+    ZSTD_DCtx *ds = s.lease->get();
+    (void)ZSTD_DCtx_reset(ds, ZSTD_reset_session_and_parameters);
+    if (s.h.windowLog) (void)ZSTD_DCtx_setParameter(ds, ZSTD_d_windowLogMax, s.h.windowLog);
+    s.outBuf.resize(CHUNK);
+}
+
+PayloadReader::~PayloadReader() = default;
+
+uint64_t PayloadReader::size() const {
+    return state_->h.origSize;
+}
+
+uint64_t PayloadReader::position() const {
+    return state_->pos;
+}
+
+uint64_t PayloadReader::read(char *dst, uint64_t capacity) {
+    return state_->advance(dst, capacity);
+}
+
+void PayloadReader::skip(uint64_t n) {
+    state_->advance(nullptr, n);
+}
+
+size_t compressBufferBound(size_t srcSize) {
+    return ZSTD_compressBound(srcSize);
+}
+
+size_t probeCompress(const void *src, size_t srcSize, int level, uint64_t srcSizeHint) {
+    auto lease = gCCtxPool.acquire();
+    ZSTD_CCtx *cctx = lease.get();
+
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    (void)ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    (void)ZSTD_CCtx_setParameter(cctx, ZSTD_c_srcSizeHint,
+                                 (int)std::min<uint64_t>(srcSizeHint, INT32_MAX));
+    const int maxWindowLog = engineLimits().maxWindowLog;
+    if ((int)ZSTD_getCParams(level, srcSizeHint, 0).windowLog > maxWindowLog) {
+        (void)ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, maxWindowLog);
+    }
+
+    // Streamed with an unknown size, or zstd would size its tables for the sample.
+    ScratchBuffer outBuf(engineLimits().chunkSize);
+    size_t written = 0;
+    ZSTD_inBuffer zin{ src, srcSize, 0 };
+    for (ZSTD_EndDirective mode : { ZSTD_e_continue, ZSTD_e_end }) {
+        size_t ret;
+        do {
+            ZSTD_outBuffer zout{ outBuf.data(), outBuf.size(), 0 };
+            ret = ZSTD_compressStream2(cctx, &zout, &zin, mode);
+            if (ZSTD_isError(ret)) {
+                throw runtime_error(string("ZSTD compress error: ") + ZSTD_getErrorName(ret));
+            }
+            written += zout.pos;
+        } while (mode == ZSTD_e_end ? ret != 0 : zin.pos < zin.size);
+    }
+    return written;
+}
+
+size_t compressBuffer(const void *src, size_t srcSize, void *dst, size_t dstCapacity, int level) {
+    auto lease = gCCtxPool.acquire();
+    ZSTD_CCtx *cctx = lease.get();
+
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    (void)ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    (void)ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+
+    size_t ret = ZSTD_compress2(cctx, dst, dstCapacity, src, srcSize);
+    if (ZSTD_isError(ret)) {
+        throw runtime_error(string("ZSTD compress error: ") + ZSTD_getErrorName(ret));
+    }
+    return ret;
+}
+
+size_t decompressBuffer(const void *src, size_t srcSize, void *dst, size_t dstCapacity) {
+    auto lease = gDCtxPool.acquire();
+    ZSTD_DCtx *dctx = lease.get();
+
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+    size_t ret = ZSTD_decompressDCtx(dctx, dst, dstCapacity, src, srcSize);
+    if (ZSTD_isError(ret)) {
+        throw runtime_error(string("ZSTD decompress error: ") + ZSTD_getErrorName(ret));
+    }
+    return ret;
+}
+
+uint64_t decompressedBufferSize(const void *src, size_t srcSize) {
+    unsigned long long size = ZSTD_getFrameContentSize(src, srcSize);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+        throw runtime_error("Not a ZSTD frame with known content size");
+    }
+    return (uint64_t)size;
 }
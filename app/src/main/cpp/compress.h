@@ -4,7 +4,48 @@
 #include <fstream>
 #include <vector>
 #include <iosfwd>
+#include <memory>
 #include <cstdint>
+#include "kitty.h"
+
+// Trade-offs the app can ask for; createArchive() resolves them to a level.
+enum class CompressPreset : int {
+    Fastest = 0,      // KP_FASTEST_LEVEL
+    Balanced = 1,     // KP_DEFAULT_LEVEL
+    Smallest = 2,     // KP_SMALLEST_LEVEL plus long-distance matching
+    TimeBudget = 3,   // strongest level expected to finish within timeBudgetSeconds
+    TargetRatio = 4   // fastest level expected to reach targetRatio
+};
+
+// Per-call settings for the archive compressors.
+struct CompressOptions {
+    CompressPreset preset = CompressPreset::Balanced;
+    uint32_t timeBudgetSeconds = 0; // TimeBudget
+    float targetRatio = 0;          // TargetRatio: original size / compressed size
+    int level = KP_DEFAULT_LEVEL;   // what the payload is compressed with
+    // "Large input" mode for backups and disk images: long-distance matching with
+    // the largest window the memory budget allows (up to 128 MiB), so repeats far
+    // apart in one file are found. The window is recorded in the payload header;
+    // extraction needs the same amount of memory per entry.
+    bool longDistance = false;
+    // Adapt the level while compressing: lower it when the encoder can't keep up
+    // with the input, raise it when the encoder waits on storage. Needs zstd
+    // workers (the level only changes between jobs); output is not reproducible.
+    bool adaptiveLevel = false;
+    // Write the compact payload layout of v6 archives (see PayloadLayout).
+    bool compactPayload = false;
+};
+
+// How a payload is laid out. Single-file KP05 files and archives up to version 5
+// embed complete, self-describing KP05 payloads. v6 archives drop the KP05
+// preamble (magic, extension, original and compressed size): the archive entry
+// already records them and hands them back through this struct.
+struct PayloadLayout {
+    bool compact = false;
+    uint64_t payloadSize = 0; // compact: total bytes of the payload
+    uint64_t origSize = 0;    // compact
+    std::string ext;          // compact
+};
 
 // High-level API used by other parts of the app:
 //
@@ -19,20 +60,127 @@ void decompressFile(const std::string &inputPath, const std::string &outputPath)
 //                         origSize: original file size (for progress tracking)
 //                         storedExt: file extension to store in KP05 header (without leading dot)
 //                         outDataSize: receives total bytes written to output (size of complete KP05 payload)
+//                         outChecksum: if non-null, receives XXH64 (seed 0) of the original bytes
+//                                      (extent table, then the data extents, for sparse files)
 void compressStreamToStream(std::istream &in, std::ostream &out, uint64_t origSize,
-                            const std::string &storedExt, uint64_t &outDataSize);
+                            const std::string &storedExt, uint64_t &outDataSize,
+                            uint64_t *outChecksum = nullptr,
+                            const CompressOptions &opts = CompressOptions());
 
 // Streaming KP05 helpers (used by archive to avoid temp buffers):
 // compressToStream: reads inputPath and writes a KP05-wrapped compressed payload directly into 'out'.
 //                  outDataSize receives the number of bytes written (size of KP05 payload).
-void compressToStream(const std::string &inputPath, std::ostream &out, uint64_t &outDataSize);
+void compressToStream(const std::string &inputPath, std::ostream &out, uint64_t &outDataSize,
+                      uint64_t *outChecksum = nullptr,
+                      const CompressOptions &opts = CompressOptions());
+// Same, for callers that already know the file size (skips the extra stat).
+void compressToStream(const std::string &inputPath, uint64_t origSize, std::ostream &out,
+                      uint64_t &outDataSize, uint64_t *outChecksum = nullptr,
+                      const CompressOptions &opts = CompressOptions());
+// Same, reading an already open fd (e.g. an Android content URI) from its start;
+// the caller keeps ownership. No extension is stored in the payload, so
+// this is meant for compact (archive) payloads whose entry records it.
+void compressToStream(int fd, uint64_t origSize, std::ostream &out, uint64_t &outDataSize,
+                      uint64_t *outChecksum = nullptr,
+                      const CompressOptions &opts = CompressOptions());
 
+// Files with holes (SEEK_DATA/SEEK_HOLE) are stored as sparse payloads: only the data
+// extents are read and compressed, and extraction recreates the holes.
+//
 // decompressFromStream: reads a KP05-wrapped payload from 'in' (starting at current position)
 //                       and writes the original file to outputPath.
 //                       dataSize is provided for context by the caller, but the function
 //                       reads exactly what KP05 format dictates (including compSize).
-void decompressFromStream(std::istream &in, uint64_t dataSize, const std::string &outputPath);
+void decompressFromStream(std::istream &in, uint64_t dataSize, const std::string &outputPath,
+                          const PayloadLayout &layout = PayloadLayout());
+// Same, with outputPath relative to the open directory dirFd (openat), so callers
+// writing many files below one root skip the path walk from '/' for each of them.
+// created, if non-null, is set once the output is open: true if this call created
+// it, false if it replaced an existing file.
+void decompressFromStream(std::istream &in, uint64_t dataSize, int dirFd,
+                          const std::string &outputPath,
+                          const PayloadLayout &layout = PayloadLayout(),
+                          bool *created = nullptr);
+// Same, writing into an open, writable fd (e.g. an Android document), whose old
+// content is replaced; the fd is closed in all cases. A failed output is left for
+// whoever created it to remove.
+void decompressToFd(std::istream &in, uint64_t dataSize, int fd,
+                    const PayloadLayout &layout = PayloadLayout());
+
+// payloadDecoderSize: reads the KP05 payload header and the zstd frame header at the
+//                     current position of 'in' and returns the memory a streaming decoder
+//                     needs for that frame (its window, bounded by the content size).
+//                     0 for stored payloads, and for unreadable ones (decoding reports those).
+uint64_t payloadDecoderSize(std::istream &in, const PayloadLayout &layout = PayloadLayout());
+
+// hashFromStream: decodes a KP05 payload like decompressFromStream but discards the bytes,
+//                 returning XXH64 (seed 0) of the decoded content. Nothing is written to disk.
+//                 For sparse payloads the hash covers the extent table and then the data
+//                 extents (holes excluded), so damaged offsets don't verify either.
+//                 Throws if the payload is corrupt or decodes to the wrong size.
+uint64_t hashFromStream(std::istream &in, uint64_t dataSize,
+                        const PayloadLayout &layout = PayloadLayout());
+
+// outputMatchesPayload: reads the KP05 payload header from 'in' and checks whether the file
+//                       decompressFromStream would write for it (outputPath plus the stored
+//                       extension) is already there: same size, and XXH64 of its content
+//                       (extent table and data extents for sparse payloads, as in
+//                       hashFromStream) equal to 'checksum'. Only the existing file is
+//                       read; nothing is decoded.
+bool outputMatchesPayload(std::istream &in, const std::string &outputPath, uint64_t checksum,
+                          const PayloadLayout &layout = PayloadLayout());
+bool outputMatchesPayload(std::istream &in, int dirFd, const std::string &outputPath,
+                          uint64_t checksum, const PayloadLayout &layout = PayloadLayout());
+// Same check on a file the caller opened for reading (fd stays open).
+bool fdMatchesPayload(std::istream &in, int fd, uint64_t checksum,
+                      const PayloadLayout &layout = PayloadLayout());
+
+// PayloadReader: pulls the decoded content of a KP05 payload piece by piece, for
+//                previews that stream an entry through a small buffer. The header is
+//                read at the current position of 'in', which must outlive the reader and
+//                not be used by anything else meanwhile. The zstd stream and the position
+//                are kept between calls, so reading a payload in n pieces decodes it once.
+class PayloadReader {
+public:
+    explicit PayloadReader(std::istream &in, const PayloadLayout &layout = PayloadLayout());
+    ~PayloadReader();
+
+    PayloadReader(const PayloadReader&) = delete;
+    PayloadReader& operator=(const PayloadReader&) = delete;
+
+    // decoded size of the payload, and how much of it was read or skipped so far
+    uint64_t size() const;
+    uint64_t position() const;
+
+    // Copies up to 'capacity' bytes from position() on into dst and returns how many;
+    // fewer only at the end of the payload. Throws if the payload is corrupt.
+    uint64_t read(char *dst, uint64_t capacity);
+
+    // Drops the next n bytes (or up to the end). They are decoded all the same;
+    // the holes of a sparse payload cost nothing.
+    void skip(uint64_t n);
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
 
 // Raw store/restore helpers (used when storing an uncompressed payload inside a KP05 file)
 void storeRawFile(const std::string &inputPath, const std::string &outputPath);
-void restoreRawFile(std::ifstream &inStream, const std::string &outputPath);
\ No newline at end of file
+void restoreRawFile(std::ifstream &inStream, const std::string &outputPath);
+
+// In-memory helpers for app-internal data (caches, small blobs). They work on a
+// plain zstd frame (no KP05 header) and reuse pooled contexts across calls.
+// compressBufferBound: worst-case compressed size for srcSize input bytes.
+// compressBuffer / decompressBuffer: one-shot; return bytes written to dst,
+//                                    throw if dst is too small or data is corrupt.
+// decompressedBufferSize: original size stored in the frame header of src.
+size_t compressBufferBound(size_t srcSize);
+size_t compressBuffer(const void *src, size_t srcSize, void *dst, size_t dstCapacity, int level);
+size_t decompressBuffer(const void *src, size_t srcSize, void *dst, size_t dstCapacity);
+uint64_t decompressedBufferSize(const void *src, size_t srcSize);
+
+// Compresses a sample single-threaded, with the tables zstd would use for a
+// payload of srcSizeHint bytes, and returns the compressed size (the output is
+// discarded). Used to time levels before picking one.
+size_t probeCompress(const void *src, size_t srcSize, int level, uint64_t srcSizeHint);
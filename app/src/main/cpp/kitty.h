@@ -5,4 +5,21 @@
 
 // Single unified magic for KP05
 static const std::string KITTY_MAGIC = "KP05";
-static const uint8_t KITTY_VERSION = 5;
+static const uint8_t KITTY_VERSION = 6;
+// Oldest archive version extraction still reads (v5: fixed-width entry headers)
+static const uint8_t KITTY_MIN_VERSION = 5;
+
+// zstd level used for archive entries
+static const int KP_DEFAULT_LEVEL = -3;
+// Ends of the level range the presets pick from
+static const int KP_FASTEST_LEVEL = -7;
+static const int KP_SMALLEST_LEVEL = 19;
+
+// Archive entry flags
+static const uint8_t KP_ENTRY_COMPRESSED   = 0x01;
+static const uint8_t KP_ENTRY_HAS_CHECKSUM = 0x02; // u64 XXH64 of content follows the stored ext
+static const uint8_t KP_ENTRY_HAS_EXT      = 0x04; // v6: ext stored, not the path's own extension
+// Flags each archive version may carry. Readers refuse any other bit: it would
+// mean header fields they don't know about, so a new flag needs a new version.
+static const uint8_t KP_ENTRY_FLAGS_V5 = KP_ENTRY_COMPRESSED | KP_ENTRY_HAS_CHECKSUM;
+static const uint8_t KP_ENTRY_FLAGS_V6 = KP_ENTRY_FLAGS_V5 | KP_ENTRY_HAS_EXT;
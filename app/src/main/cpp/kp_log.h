@@ -1,13 +1,22 @@
 #pragma once
 
+#ifdef __ANDROID__
 #include <android/log.h>
+#else
+// Host builds (tools/kp_train) have no logcat
+#include <cstdio>
+#endif
 
 #ifdef NDEBUG
 // -------- RELEASE BUILD --------
 #define KP_LOGI(...)
 #define KP_LOGE(...)
-#else
+#elif defined(__ANDROID__)
 // -------- DEBUG BUILD --------
 #define KP_LOGI(...) __android_log_print(ANDROID_LOG_INFO,  "KittyPress", __VA_ARGS__)
 #define KP_LOGE(...) __android_log_print(ANDROID_LOG_ERROR, "KittyPress", __VA_ARGS__)
+#else
+// -------- DEBUG BUILD, HOST --------
+#define KP_LOGI(...) (std::fprintf(stderr, "KittyPress I: " __VA_ARGS__), std::fputc('\n', stderr))
+#define KP_LOGE(...) (std::fprintf(stderr, "KittyPress E: " __VA_ARGS__), std::fputc('\n', stderr))
 #endif
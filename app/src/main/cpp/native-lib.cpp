@@ -6,9 +6,20 @@
 #include "compress.h"
 #include "progress.h"
 #include "kp_log.h"
+#include "cancel.h"
+#include "budget.h"
+#include "workers.h"
 #include <atomic>
 #include <mutex>
-#include <fstream>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 
 // Forward: We'll store JVM pointer and callback refs
 static JavaVM* gJvm = nullptr;
@@ -19,6 +30,8 @@ static std::mutex gProgressMutex;
 static std::atomic<uint64_t> g_totalBytes{0};
 static std::atomic<uint64_t> g_processedBytes{0};
 
+// Pool threads attach when they start (hooks set in JNI_OnLoad), so the
+// attach/detach below only happens on the odd thread outside the pool.
 static void call_java_progress(int pct) {
     std::lock_guard<std::mutex> lock(gProgressMutex);
     if (!gJvm || !gProgressClassGlobal || !gOnProgressMethod) return;
@@ -43,12 +56,30 @@ static void call_java_progress(int pct) {
     if (attached) gJvm->DetachCurrentThread();
 }
 
-// JNI_OnLoad to capture JavaVM*
+// JNI_OnLoad to capture JavaVM* and set up the worker pool. Its threads start
+// with the first parallel job, not here, so loading the library stays cheap
+// (see setWorkerThreadHooks); each attaches to the JVM once, as it starts.
 jint JNI_OnLoad(JavaVM* vm, void* reserved) {
     gJvm = vm;
+
+    WorkerThreadHooks hooks;
+    hooks.onStart = []() {
+        JNIEnv* env = nullptr;
+        // daemon: parked pool threads must not keep the VM from shutting down
+        if (gJvm->AttachCurrentThreadAsDaemon(&env, nullptr) != 0) {
+            KP_LOGE("AttachCurrentThreadAsDaemon failed");
+        }
+    };
+    hooks.onStop = []() { gJvm->DetachCurrentThread(); };
+    setWorkerThreadHooks(hooks);
+
     return JNI_VERSION_1_6;
 }
 
+void JNI_OnUnload(JavaVM* vm, void* reserved) {
+    stopWorkerPool();
+}
+
 // Implementation of progress.h functions
 extern "C" void native_progress_reset() {
     g_totalBytes.store(0);
@@ -74,6 +105,20 @@ extern "C" void native_progress_add_processed(uint64_t bytes) {
     call_java_progress(pct);
 }
 
+// Cancel tokens handed out by newCancelTokenNative: id -> flag of the call it is
+// passed to. Ids aren't reused, so cancelling a released token does nothing.
+static std::mutex gCancelMutex;
+static std::unordered_map<jlong, CancelFlag> gCancelTokens;
+static jlong gLastCancelToken = 0;
+
+// Flag to bind for a call given 'token'; null (not cancellable) for 0 or a token
+// that was released.
+static CancelFlag cancelFlagFor(jlong token) {
+    std::lock_guard<std::mutex> lock(gCancelMutex);
+    auto it = gCancelTokens.find(token);
+    return it == gCancelTokens.end() ? CancelFlag() : it->second;
+}
+
 // Safe conversion: handles null jstring
 static std::string toStr(JNIEnv* env, jstring js) {
     if (js == nullptr) return std::string();
@@ -129,129 +174,230 @@ KP_LOGI("registerProgressCallback: registered");
 }
 }
 
+// Reads a com.deepion.kittypress.CompressionOptions; null means defaults.
+// Field names and types must match CompressionOptions.kt.
+// Throws (the caller returns its error code) if a field is missing, e.g. renamed
+// in Kotlin or stripped by R8 without a keep rule.
+static CompressOptions toCompressOptions(JNIEnv* env, jobject options) {
+    CompressOptions opts;
+    if (options == nullptr) return opts;
+
+    jclass cls = env->GetObjectClass(options);
+    jfieldID preset = env->GetFieldID(cls, "preset", "I");
+    jfieldID timeBudget = preset ? env->GetFieldID(cls, "timeBudgetSeconds", "I") : nullptr;
+    jfieldID targetRatio = timeBudget ? env->GetFieldID(cls, "targetRatio", "F") : nullptr;
+    jfieldID largeInput = targetRatio ? env->GetFieldID(cls, "largeInput", "Z") : nullptr;
+    jfieldID adaptiveLevel = largeInput ? env->GetFieldID(cls, "adaptiveLevel", "Z") : nullptr;
+    env->DeleteLocalRef(cls);
+    if (!adaptiveLevel) {
+        env->ExceptionClear();
+        throw std::runtime_error("CompressionOptions field not found");
+    }
+
+    opts.preset = (CompressPreset)env->GetIntField(options, preset);
+    opts.timeBudgetSeconds = (uint32_t)std::max<jint>(0, env->GetIntField(options, timeBudget));
+    opts.targetRatio = env->GetFloatField(options, targetRatio);
+    opts.longDistance = env->GetBooleanField(options, largeInput) == JNI_TRUE;
+    opts.adaptiveLevel = env->GetBooleanField(options, adaptiveLevel) == JNI_TRUE;
+    return opts;
+}
+
 // EXISTING: Multi-file archive compression
 extern "C" JNIEXPORT jint JNICALL
         Java_com_deepion_kittypress_KittyPressNative_compressNative(
-        JNIEnv* env, jobject, jobjectArray inputArray, jstring outPath) {
+        JNIEnv* env, jobject, jobjectArray inputArray, jstring outPath, jobject options, jlong cancelToken) {
 try {
 auto inputs = toStrArray(env, inputArray);
 std::string out = toStr(env, outPath);
+CompressOptions opts = toCompressOptions(env, options);
 
-KP_LOGI("Compressing to: %s", out.c_str());
+KP_LOGI("Compressing to: %s (preset %d)%s%s", out.c_str(), (int)opts.preset,
+        opts.longDistance ? " (large input mode)" : "", opts.adaptiveLevel ? " (adaptive level)" : "");
 for (size_t i = 0; i < inputs.size(); ++i) {
 KP_LOGI("  input[%zu] = %s", i, inputs[i].c_str());
 }
 
+CancelScope cancelScope(cancelFlagFor(cancelToken));
 native_progress_reset();
-createArchive(inputs, out);
+createArchive(inputs, out, opts);
 call_java_progress(100);
 return 0;
+} catch (const OperationCancelled&) {
+KP_LOGI("Compression cancelled");
+return 2;
 } catch (const std::exception& e) {
 KP_LOGE("Error: %s", e.what());
 return 1;
 }
 }
 
-// NEW: Single-file streaming compression (input URI → output URI, direct streaming)
-extern "C" JNIEXPORT jint JNICALL
-        Java_com_deepion_kittypress_KittyPressNative_compressSingleFileStreamNative(
-        JNIEnv* env, jobject, jstring inputPath, jstring outputPath) {
-try {
-std::string inPath = toStr(env, inputPath);
-std::string outPath = toStr(env, outputPath);
-
-KP_LOGI("Single-file streaming compress: %s -> %s", inPath.c_str(), outPath.c_str());
+// InputOpener calling source.openInput(handle) with an input's absPath (a document
+// URI); empty if source is null. The fd it returns is detached, -1 on failure.
+static InputOpener documentOpener(JNIEnv* env, jobject source) {
+if (!source) return InputOpener();
+
+jclass sourceClass = env->GetObjectClass(source);
+jmethodID openInput = env->GetMethodID(sourceClass, "openInput", "(Ljava/lang/String;)I");
+env->DeleteLocalRef(sourceClass);
+if (!openInput) {
+env->ExceptionClear();
+throw std::runtime_error("InputSource.openInput not found");
+}
 
-// Open input file
-std::ifstream in(inPath, std::ios::binary);
-if (!in) {
-KP_LOGE("Cannot open input file: %s", inPath.c_str());
-return 1;
+return [env, source, openInput](const ArchiveInput& f) -> int {
+jstring jhandle = env->NewStringUTF(f.absPath.c_str());
+if (!jhandle) {
+env->ExceptionClear();
+return -1;
+}
+jint fd = env->CallIntMethod(source, openInput, jhandle);
+env->DeleteLocalRef(jhandle);
+if (env->ExceptionCheck()) {
+env->ExceptionClear();
+return -1;
+}
+return fd;
+};
 }
 
-// Get file size
-in.seekg(0, std::ios::end);
-uint64_t fileSize = in.tellg();
-in.seekg(0, std::ios::beg);
+// Continues an archive whose compressNative()/compressTreeNative() run was killed
+// (see createArchive()); source reopens the documents of a compressTreeNative()
+// archive and may be null for the others. Same return codes as compressNative.
+extern "C" JNIEXPORT jint JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_resumeNative(
+        JNIEnv* env, jobject, jstring outPath, jobject source, jlong cancelToken) {
+try {
+std::string out = toStr(env, outPath);
+KP_LOGI("Resuming archive: %s", out.c_str());
 
-// Open output file
-std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
-if (!out) {
-KP_LOGE("Cannot open output file: %s", outPath.c_str());
+CancelScope cancelScope(cancelFlagFor(cancelToken));
+native_progress_reset();
+resumeArchive(out, documentOpener(env, source));
+call_java_progress(100);
+return 0;
+} catch (const OperationCancelled&) {
+KP_LOGI("Compression cancelled");
+return 2;
+} catch (const std::exception& e) {
+KP_LOGE("Resume error: %s", e.what());
 return 1;
 }
+}
 
-// Set progress total to file size
-native_progress_set_total(fileSize);
+extern "C" JNIEXPORT jboolean JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_canResumeNative(
+        JNIEnv* env, jobject, jstring outPath) {
+try {
+return canResumeArchive(toStr(env, outPath)) ? JNI_TRUE : JNI_FALSE;
+} catch (const std::exception& e) {
+KP_LOGE("Checkpoint error: %s", e.what());
+return JNI_FALSE;
+}
+}
 
-// Get extension
-std::string ext;
-size_t dotPos = inPath.rfind('.');
-if (dotPos != std::string::npos && dotPos < inPath.size() - 1) {
-ext = inPath.substr(dotPos + 1);
+// Archive compression straight from Android documents (no copy into cacheDir).
+// 'packed' lists the inputs in archive order (little-endian):
+//   u32 count, then per entry: u16 pathLen, path (UTF-8, archive path), u64 size,
+//   u16 uriLen, uri (UTF-8, document to read)
+// and source.openInput(uri) returns a detached, readable fd for that document
+// (-1 if it can't be opened); it is called on this thread, one entry at a time,
+// and the fd is closed after use. The checkpoint keeps the URIs, so resumeNative
+// can reopen the documents. Same return codes as compressNative.
+extern "C" JNIEXPORT jint JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_compressTreeNative(
+        JNIEnv* env, jobject, jbyteArray packed, jobject source, jstring outPath, jobject options, jlong cancelToken) {
+try {
+std::string out = toStr(env, outPath);
+CompressOptions opts = toCompressOptions(env, options);
+
+const jsize packedLen = env->GetArrayLength(packed);
+std::vector<uint8_t> buf((size_t)packedLen);
+env->GetByteArrayRegion(packed, 0, packedLen, reinterpret_cast<jbyte*>(buf.data()));
+
+size_t pos = 0;
+auto take = [&](void* dst, size_t n) {
+if (buf.size() - pos < n) throw std::runtime_error("Truncated input list");
+memcpy(dst, buf.data() + pos, n);
+pos += n;
+};
+uint32_t count = 0;
+take(&count, 4);
+std::vector<ArchiveInput> files;
+files.reserve(std::min<size_t>(count, buf.size() / 12));
+for (uint32_t i = 0; i < count; ++i) {
+ArchiveInput f;
+uint16_t pathLen = 0;
+take(&pathLen, 2);
+f.relPath.resize(pathLen);
+take(&f.relPath[0], pathLen);
+take(&f.size, 8);
+// -1 from the provider: the caller copies such documents first
+if (f.size > (uint64_t)INT64_MAX) throw std::runtime_error("Unknown input size: " + f.relPath);
+uint16_t uriLen = 0;
+take(&uriLen, 2);
+f.absPath.resize(uriLen);
+take(&f.absPath[0], uriLen);
+files.push_back(std::move(f));
 }
 
-// Compress stream to stream
-uint64_t outDataSize = 0;
-compressStreamToStream(in, out, fileSize, ext, outDataSize);
+InputOpener opener = documentOpener(env, source);
+if (!opener) throw std::runtime_error("No input source");
 
-in.close();
-out.close();
+KP_LOGI("Compressing %u document(s) to: %s (preset %d)", count, out.c_str(), (int)opts.preset);
 
+CancelScope cancelScope(cancelFlagFor(cancelToken));
+native_progress_reset();
+createArchive(files, opener, out, opts);
 call_java_progress(100);
-KP_LOGI("Single-file compress complete: %llu -> %llu bytes", fileSize, outDataSize);
 return 0;
-
+} catch (const OperationCancelled&) {
+KP_LOGI("Compression cancelled");
+return 2;
 } catch (const std::exception& e) {
-KP_LOGE("Single-file compress error: %s", e.what());
+KP_LOGE("Error: %s", e.what());
 return 1;
 }
 }
 
-// NEW: Single-file streaming decompression (input URI → output URI, direct streaming)
+// Single-file archive read straight from an opened document: 'fd' is a detached
+// ParcelFileDescriptor (closed here in all cases), 'size' its statSize and 'name'
+// the entry's path in the archive. Same return codes as compressNative.
 extern "C" JNIEXPORT jint JNICALL
-        Java_com_deepion_kittypress_KittyPressNative_decompressSingleFileStreamNative(
-        JNIEnv* env, jobject, jstring inputPath, jstring outputPath) {
+        Java_com_deepion_kittypress_KittyPressNative_compressFdNative(
+        JNIEnv* env, jobject, jint fd, jlong size, jstring name, jstring outPath, jobject options, jlong cancelToken) {
+struct OwnedFd {
+int fd;
+~OwnedFd() { if (fd >= 0) ::close(fd); }
+} input{fd};
 try {
-std::string inPath = toStr(env, inputPath);
-std::string outPath = toStr(env, outputPath);
-
-KP_LOGI("Single-file streaming decompress: %s -> %s", inPath.c_str(), outPath.c_str());
-
-// Open input file
-std::ifstream in(inPath, std::ios::binary);
-if (!in) {
-KP_LOGE("Cannot open input file: %s", inPath.c_str());
-return 1;
-}
-
-// Get file size for progress
-in.seekg(0, std::ios::end);
-uint64_t fileSize = in.tellg();
-in.seekg(0, std::ios::beg);
-
-// Set progress total to compressed file size
-native_progress_set_total(fileSize);
+if (input.fd < 0 || size < 0) throw std::runtime_error("Invalid input descriptor");
+std::string out = toStr(env, outPath);
+CompressOptions opts = toCompressOptions(env, options);
 
-KP_LOGI("Input file size: %llu bytes", fileSize);
+ArchiveInput f;
+f.relPath = toStr(env, name);
+f.size = (uint64_t)size;
 
-// For single-file streaming, the entire file IS the KP05 payload
-// (no archive wrapper), so we read and decompress directly
-try {
-decompressFromStream(in, fileSize, outPath);
-} catch (const std::exception& e) {
-KP_LOGE("Decompression failed: %s", e.what());
-throw;
-}
+// the engine closes what the opener returns and may open an input twice
+// (preset sampling), so hand out duplicates; it reads from offset 0 itself.
+// No absPath: a single entry has nothing to resume, so no checkpoint is written
+InputOpener opener = [&input](const ArchiveInput&) -> int {
+return ::fcntl(input.fd, F_DUPFD_CLOEXEC, 0);
+};
 
-in.close();
+KP_LOGI("Compressing document %s (%lld bytes) to: %s (preset %d)", f.relPath.c_str(),
+        (long long)size, out.c_str(), (int)opts.preset);
 
+CancelScope cancelScope(cancelFlagFor(cancelToken));
+native_progress_reset();
+createArchive(std::vector<ArchiveInput>{f}, opener, out, opts);
 call_java_progress(100);
-KP_LOGI("Single-file decompress complete");
 return 0;
-
+} catch (const OperationCancelled&) {
+KP_LOGI("Compression cancelled");
+return 2;
 } catch (const std::exception& e) {
-KP_LOGE("Single-file decompress error: %s", e.what());
+KP_LOGE("Error: %s", e.what());
 return 1;
 }
 }
@@ -259,15 +405,16 @@ return 1;
 // EXISTING: Multi-file archive extraction (handles 1 or multiple files)
 extern "C" JNIEXPORT jstring JNICALL
         Java_com_deepion_kittypress_KittyPressNative_decompressNative(
-        JNIEnv* env, jobject, jstring archivePath, jstring outputFolder) {
+        JNIEnv* env, jobject, jstring archivePath, jstring outputFolder, jboolean resume, jlong cancelToken) {
 try {
 std::string in = toStr(env, archivePath);
 std::string out = toStr(env, outputFolder);
 
-KP_LOGI("Decompressing archive: %s -> %s", in.c_str(), out.c_str());
+KP_LOGI("Decompressing archive: %s -> %s%s", in.c_str(), out.c_str(), resume ? " (resume)" : "");
 
+CancelScope cancelScope(cancelFlagFor(cancelToken));
 native_progress_reset();
-std::string extractedName = extractArchive(in, out);
+std::string extractedName = extractArchive(in, out, resume == JNI_TRUE);
 call_java_progress(100);
 return env->NewStringUTF(extractedName.c_str());
 
@@ -275,4 +422,304 @@ return env->NewStringUTF(extractedName.c_str());
 KP_LOGE("Error: %s", e.what());
 return nullptr;
 }
-}
\ No newline at end of file
+}
+
+// Archive extraction straight into Android documents (no staging in cacheDir).
+// sink.openOutput(path) returns a detached fd for 'path' relative to the
+// destination folder (see OutputOpener in archive.h), -1 on failure; it is called
+// on this thread. On error or cancel, sink.discardOutput(path) gets the outputs
+// that weren't finished (see OutputDiscarder), finished ones are left in place.
+// Returns the root name like decompressNative, null on error or cancel.
+extern "C" JNIEXPORT jstring JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_decompressToTreeNative(
+        JNIEnv* env, jobject, jstring archivePath, jobject sink, jboolean resume, jlong cancelToken) {
+try {
+std::string in = toStr(env, archivePath);
+
+jclass sinkClass = env->GetObjectClass(sink);
+jmethodID openOutput = env->GetMethodID(sinkClass, "openOutput", "(Ljava/lang/String;)I");
+jmethodID discardOutput = env->GetMethodID(sinkClass, "discardOutput", "(Ljava/lang/String;)V");
+env->DeleteLocalRef(sinkClass);
+if (!openOutput || !discardOutput) {
+env->ExceptionClear();
+return nullptr;
+}
+
+OutputOpener opener = [env, sink, openOutput](const std::string& path) -> int {
+jstring jpath = env->NewStringUTF(path.c_str());
+if (!jpath) {
+env->ExceptionClear();
+return -1;
+}
+jint fd = env->CallIntMethod(sink, openOutput, jpath);
+env->DeleteLocalRef(jpath);
+if (env->ExceptionCheck()) {
+env->ExceptionClear();
+return -1;
+}
+return fd;
+};
+
+OutputDiscarder discarder = [env, sink, discardOutput](const std::string& path) {
+jstring jpath = env->NewStringUTF(path.c_str());
+if (!jpath) {
+env->ExceptionClear();
+return;
+}
+env->CallVoidMethod(sink, discardOutput, jpath);
+env->DeleteLocalRef(jpath);
+if (env->ExceptionCheck()) env->ExceptionClear();
+};
+
+KP_LOGI("Decompressing archive into documents: %s%s", in.c_str(), resume ? " (resume)" : "");
+
+CancelScope cancelScope(cancelFlagFor(cancelToken));
+native_progress_reset();
+std::string extractedName = extractArchive(in, opener, resume == JNI_TRUE, discarder);
+call_java_progress(100);
+return env->NewStringUTF(extractedName.c_str());
+
+} catch (const std::exception& e) {
+KP_LOGE("Error: %s", e.what());
+return nullptr;
+}
+}
+// Archive listing without decompression. Entries are packed into one byte[]
+// (little-endian) instead of building a jstring per entry:
+//   u32 count, then per entry: u16 pathLen, path (UTF-8), u8 flags,
+//   u64 origSize, u64 dataSize
+extern "C" JNIEXPORT jbyteArray JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_listNative(
+        JNIEnv* env, jobject, jstring archivePath) {
+try {
+std::string in = toStr(env, archivePath);
+std::vector<ArchiveEntry> entries = listArchive(in);
+
+size_t packedSize = 4;
+for (const auto& e : entries) packedSize += 2 + e.rel.size() + 1 + 8 + 8;
+
+std::vector<uint8_t> packed(packedSize);
+uint8_t* p = packed.data();
+auto put = [&p](const void* src, size_t n) { memcpy(p, src, n); p += n; };
+
+uint32_t count = (uint32_t)entries.size();
+put(&count, 4);
+for (const auto& e : entries) {
+uint16_t pathLen = (uint16_t)e.rel.size();
+put(&pathLen, 2);
+put(e.rel.data(), pathLen);
+put(&e.flags, 1);
+put(&e.origSize, 8);
+put(&e.dataSize, 8);
+}
+
+jbyteArray result = env->NewByteArray((jsize)packed.size());
+if (!result) return nullptr;
+env->SetByteArrayRegion(result, 0, (jsize)packed.size(), reinterpret_cast<const jbyte*>(packed.data()));
+return result;
+
+} catch (const std::exception& e) {
+KP_LOGE("List error: %s", e.what());
+return nullptr;
+}
+}
+
+// Integrity check: decodes every entry without writing anything and compares
+// against the stored checksums. Returns number of corrupt entries, -1 on error.
+extern "C" JNIEXPORT jint JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_verifyNative(
+        JNIEnv* env, jobject, jstring archivePath, jlong cancelToken) {
+try {
+std::string in = toStr(env, archivePath);
+
+KP_LOGI("Verifying archive: %s", in.c_str());
+
+CancelScope cancelScope(cancelFlagFor(cancelToken));
+std::vector<std::string> corrupt = verifyArchive(in);
+for (const auto& rel : corrupt) {
+KP_LOGE("  corrupt entry: %s", rel.c_str());
+}
+call_java_progress(100);
+return (jint)corrupt.size();
+
+} catch (const std::exception& e) {
+KP_LOGE("Verify error: %s", e.what());
+return -1;
+}
+}
+
+// In-app preview: decodes entry 'index' straight into a direct ByteBuffer,
+// starting 'offset' bytes into the entry. Returns bytes written, -1 on error.
+extern "C" JNIEXPORT jlong JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_readEntryNative(
+        JNIEnv* env, jobject, jstring archivePath, jint index, jlong offset, jobject dst) {
+try {
+std::string in = toStr(env, archivePath);
+
+char* buf = dst ? static_cast<char*>(env->GetDirectBufferAddress(dst)) : nullptr;
+jlong capacity = dst ? env->GetDirectBufferCapacity(dst) : -1;
+if (!buf || capacity < 0 || index < 0 || offset < 0) {
+KP_LOGE("readEntryNative: need a direct ByteBuffer and non-negative index/offset");
+return -1;
+}
+
+uint64_t written = extractEntryToMemory(in, (uint32_t)index, (uint64_t)offset, buf, (uint64_t)capacity);
+return (jlong)written;
+
+} catch (const std::exception& e) {
+KP_LOGE("Read entry error: %s", e.what());
+return -1;
+}
+}
+
+// Streaming preview: an EntryReader for entry 'index', positioned 'offset' bytes
+// in, as an opaque handle for readEntryStreamNative/closeEntryNative. 0 on error.
+extern "C" JNIEXPORT jlong JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_openEntryNative(
+        JNIEnv* env, jobject, jstring archivePath, jint index, jlong offset) {
+try {
+if (index < 0 || offset < 0) {
+KP_LOGE("openEntryNative: need non-negative index/offset");
+return 0;
+}
+std::unique_ptr<EntryReader> reader(new EntryReader(toStr(env, archivePath), (uint32_t)index));
+reader->skip((uint64_t)offset);
+return (jlong)(intptr_t)reader.release();
+
+} catch (const std::exception& e) {
+KP_LOGE("Open entry error: %s", e.what());
+return 0;
+}
+}
+
+// Next bytes of an openEntryNative reader into a direct ByteBuffer. Returns bytes
+// written (0 at the end of the entry), -1 on error.
+extern "C" JNIEXPORT jlong JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_readEntryStreamNative(
+        JNIEnv* env, jobject, jlong handle, jobject dst) {
+try {
+auto* reader = reinterpret_cast<EntryReader*>((intptr_t)handle);
+char* buf = dst ? static_cast<char*>(env->GetDirectBufferAddress(dst)) : nullptr;
+jlong capacity = dst ? env->GetDirectBufferCapacity(dst) : -1;
+if (!reader || !buf || capacity < 0) {
+KP_LOGE("readEntryStreamNative: need an open reader and a direct ByteBuffer");
+return -1;
+}
+return (jlong)reader->read(buf, (uint64_t)capacity);
+
+} catch (const std::exception& e) {
+KP_LOGE("Read entry error: %s", e.what());
+return -1;
+}
+}
+
+extern "C" JNIEXPORT void JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_closeEntryNative(
+        JNIEnv*, jobject, jlong handle) {
+delete reinterpret_cast<EntryReader*>((intptr_t)handle);
+}
+
+// In-memory compression between direct ByteBuffers (plain zstd frame, no KP05
+// header). Both buffers are used from address 0; nothing is copied across JNI.
+// Returns compressed size, -1 on error (e.g. dst smaller than compressBoundNative).
+extern "C" JNIEXPORT jint JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_compressBufferNative(
+        JNIEnv* env, jobject, jobject src, jint srcLen, jobject dst, jint level) {
+try {
+char* in = src ? static_cast<char*>(env->GetDirectBufferAddress(src)) : nullptr;
+char* out = dst ? static_cast<char*>(env->GetDirectBufferAddress(dst)) : nullptr;
+if (!in || !out || srcLen < 0 || srcLen > env->GetDirectBufferCapacity(src)) {
+KP_LOGE("compressBufferNative: need direct ByteBuffers and a valid srcLen");
+return -1;
+}
+size_t written = compressBuffer(in, (size_t)srcLen, out, (size_t)env->GetDirectBufferCapacity(dst), (int)level);
+return (jint)written;
+
+} catch (const std::exception& e) {
+KP_LOGE("Buffer compress error: %s", e.what());
+return -1;
+}
+}
+
+// Inverse of compressBufferNative. Returns decompressed size, -1 on error.
+extern "C" JNIEXPORT jint JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_decompressBufferNative(
+        JNIEnv* env, jobject, jobject src, jint srcLen, jobject dst) {
+try {
+char* in = src ? static_cast<char*>(env->GetDirectBufferAddress(src)) : nullptr;
+char* out = dst ? static_cast<char*>(env->GetDirectBufferAddress(dst)) : nullptr;
+if (!in || !out || srcLen < 0 || srcLen > env->GetDirectBufferCapacity(src)) {
+KP_LOGE("decompressBufferNative: need direct ByteBuffers and a valid srcLen");
+return -1;
+}
+size_t written = decompressBuffer(in, (size_t)srcLen, out, (size_t)env->GetDirectBufferCapacity(dst));
+return (jint)written;
+
+} catch (const std::exception& e) {
+KP_LOGE("Buffer decompress error: %s", e.what());
+return -1;
+}
+}
+
+// Worst-case compressed size, for sizing the dst buffer of compressBufferNative.
+// -1 when srcLen is negative or the bound doesn't fit a jint (srcLen close to
+// 2 GiB): no ByteBuffer could hold such a frame.
+extern "C" JNIEXPORT jint JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_compressBoundNative(
+        JNIEnv*, jobject, jint srcLen) {
+if (srcLen < 0) return -1;
+const size_t bound = compressBufferBound((size_t)srcLen);
+if (bound > (size_t)INT32_MAX) return -1;
+return (jint)bound;
+}
+
+// Original size recorded in a compressBufferNative frame, -1 if unknown/invalid.
+extern "C" JNIEXPORT jlong JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_decompressedSizeNative(
+        JNIEnv* env, jobject, jobject src, jint srcLen) {
+try {
+char* in = src ? static_cast<char*>(env->GetDirectBufferAddress(src)) : nullptr;
+if (!in || srcLen < 0 || srcLen > env->GetDirectBufferCapacity(src)) return -1;
+return (jlong)decompressedBufferSize(in, (size_t)srcLen);
+
+} catch (const std::exception& e) {
+KP_LOGE("Buffer size error: %s", e.what());
+return -1;
+}
+}
+
+// Cancel token for one compress / extract / verify call (its cancelToken
+// argument). Never 0.
+extern "C" JNIEXPORT jlong JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_newCancelTokenNative(
+        JNIEnv*, jobject) {
+std::lock_guard<std::mutex> lock(gCancelMutex);
+const jlong token = ++gLastCancelToken;
+gCancelTokens[token] = std::make_shared<std::atomic<bool>>(false);
+return token;
+}
+
+// Asks the call given 'token' to stop, or makes it stop right away if it hasn't
+// started yet. Its workers notice within one chunk and partial outputs are removed;
+// other calls are not affected.
+extern "C" JNIEXPORT void JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_cancelNative(
+        JNIEnv*, jobject, jlong token) {
+if (CancelFlag flag = cancelFlagFor(token)) flag->store(true);
+}
+
+// Forgets 'token' once its call returned; a running call keeps its flag.
+extern "C" JNIEXPORT void JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_releaseCancelTokenNative(
+        JNIEnv*, jobject, jlong token) {
+std::lock_guard<std::mutex> lock(gCancelMutex);
+gCancelTokens.erase(token);
+}
+
+// Memory budget for the engine in bytes (0 = automatic, a share of device RAM).
+// Worker counts, buffer sizes and the compression window are sized from it.
+extern "C" JNIEXPORT void JNICALL
+        Java_com_deepion_kittypress_KittyPressNative_setMemoryBudgetNative(
+        JNIEnv*, jobject, jlong bytes) {
+setMemoryBudget(bytes > 0 ? (uint64_t)bytes : 0);
+}
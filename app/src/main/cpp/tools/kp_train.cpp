@@ -0,0 +1,73 @@
+// kp_train.cpp
+// Training run for profile-guided release builds (CMake option KP_PGO=generate,
+// see "Release build and PGO" in the README). Drives the engine over a corpus
+// the way the app does: compress with each fixed preset, verify, extract. The
+// instrumented binary writes its profile (LLVM_PROFILE_FILE) when it exits.
+#include "archive.h"
+#include "compress.h"
+#include "progress.h"
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// The JNI layer (native-lib.cpp) implements these for the app; nothing reports
+// progress here.
+extern "C" void native_progress_reset() {}
+extern "C" void native_progress_set_total(uint64_t) {}
+extern "C" void native_progress_add_processed(uint64_t) {}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "usage: %s <corpus dir or file>... <work dir>\n", argv[0]);
+        return 2;
+    }
+    const std::vector<std::string> inputs(argv + 1, argv + argc - 1);
+    const fs::path work = argv[argc - 1];
+
+    static const CompressPreset PRESETS[] = {
+        CompressPreset::Fastest, CompressPreset::Balanced, CompressPreset::Smallest
+    };
+
+    try {
+        fs::create_directories(work);
+        const std::string archive = (work / "train.kitty").string();
+        const fs::path out = work / "out";
+
+        for (CompressPreset preset : PRESETS) {
+            CompressOptions opts;
+            opts.preset = preset;
+
+            auto start = std::chrono::steady_clock::now();
+            createArchive(inputs, archive, opts);
+            std::printf("preset %d: compress %.2f s, %llu bytes\n", (int)preset,
+                        secondsSince(start), (unsigned long long)fs::file_size(archive));
+
+            start = std::chrono::steady_clock::now();
+            const size_t bad = verifyArchive(archive).size();
+            std::printf("preset %d: verify %.2f s\n", (int)preset, secondsSince(start));
+            if (bad) throw std::runtime_error("Archive failed verification");
+
+            fs::remove_all(out);
+            fs::create_directories(out);
+            start = std::chrono::steady_clock::now();
+            extractArchive(archive, out.string());
+            std::printf("preset %d: extract %.2f s\n", (int)preset, secondsSince(start));
+        }
+
+        fs::remove_all(out);
+        fs::remove(archive);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "kp_train: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
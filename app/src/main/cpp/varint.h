@@ -0,0 +1,54 @@
+// varint.h
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+// LEB128 unsigned varints used by the v6 archive headers: 7 bits per byte,
+// low bits first, high bit set on every byte but the last.
+static const size_t KP_VARINT_MAX_BYTES = 10;
+
+// Encodes v into buf (at least KP_VARINT_MAX_BYTES); returns the byte count.
+inline size_t encodeVarint(uint64_t v, char* buf) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (char)(uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (char)(uint8_t)v;
+    return n;
+}
+
+inline void writeVarint(std::ostream& out, uint64_t v) {
+    char buf[KP_VARINT_MAX_BYTES];
+    out.write(buf, (std::streamsize)encodeVarint(v, buf));
+}
+
+// Always KP_VARINT_MAX_BYTES long (non-minimal encoding), for values that are
+// patched in place once known. readVarint() accepts it like any other varint.
+inline void encodePaddedVarint(uint64_t v, char* buf) {
+    for (size_t i = 0; i + 1 < KP_VARINT_MAX_BYTES; ++i) {
+        buf[i] = (char)(uint8_t)((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf[KP_VARINT_MAX_BYTES - 1] = (char)(uint8_t)v;
+}
+
+// Reads one varint; 'consumed' (if non-null) is increased by its length.
+// Throws on EOF and on encodings longer than 64 bits.
+inline uint64_t readVarint(std::istream& in, uint64_t* consumed = nullptr) {
+    uint64_t v = 0;
+    for (unsigned i = 0; i < KP_VARINT_MAX_BYTES; ++i) {
+        const int c = in.get();
+        if (c == std::char_traits<char>::eof()) throw std::runtime_error("Truncated varint");
+        const uint64_t bits = (uint64_t)(c & 0x7f);
+        if (i == KP_VARINT_MAX_BYTES - 1 && bits > 1) throw std::runtime_error("Varint overflow");
+        v |= bits << (7 * i);
+        if (!(c & 0x80)) {
+            if (consumed) *consumed += i + 1;
+            return v;
+        }
+    }
+    throw std::runtime_error("Varint overflow");
+}
@@ -0,0 +1,143 @@
+// workers.cpp
+#include "workers.h"
+#include "cancel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+class WorkerPool {
+public:
+    void setHooks(const WorkerThreadHooks& hooks) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hooks_ = hooks;
+    }
+
+    void stop() {
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            threads.swap(threads_);
+        }
+        cv_.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            startLocked();
+            queue_.push_back(std::move(task));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    // First post() (or the first after stop()) starts the threads; each one
+    // keeps the hooks that were set when it was created.
+    void startLocked() {
+        if (!threads_.empty()) return;
+
+        stopping_ = false;
+        const unsigned hw = std::thread::hardware_concurrency();
+        const unsigned count = std::max(2u, hw);
+        for (unsigned i = 0; i < count; ++i) {
+            threads_.emplace_back([this, hooks = hooks_]() { loop(hooks); });
+        }
+    }
+
+    void loop(const WorkerThreadHooks& hooks) {
+        if (hooks.onStart) hooks.onStart();
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) break;
+                task = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            task();
+        }
+        if (hooks.onStop) hooks.onStop();
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<std::thread> threads_;
+    WorkerThreadHooks hooks_;
+    bool stopping_ = false;
+};
+
+// Never destroyed: the threads may still be parked when the process exits.
+WorkerPool& pool() {
+    static WorkerPool* p = new WorkerPool();
+    return *p;
+}
+
+// One runParallel() call. Pool threads and the caller claim slots from
+// 'next'; whoever comes late finds nothing left and returns. Slots run with
+// the caller's cancel flag bound, wherever they run.
+struct ParallelJob {
+    ParallelJob(unsigned n, const std::function<void(unsigned)>& fn)
+            : count(n), body(fn), cancel(boundCancelFlag()) {}
+
+    void runSlots() {
+        CancelScope scope(cancel);
+        while (true) {
+            const unsigned slot = next.fetch_add(1);
+            if (slot >= count) return;
+            try {
+                body(slot);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++done == count) cv.notify_all();
+        }
+    }
+
+    const unsigned count;
+    const std::function<void(unsigned)>& body; // caller waits until every slot is done
+    const CancelFlag cancel;
+    std::atomic<unsigned> next{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned done = 0;
+    std::exception_ptr error;
+};
+
+} // namespace
+
+void setWorkerThreadHooks(const WorkerThreadHooks& hooks) {
+    pool().setHooks(hooks);
+}
+
+void stopWorkerPool() {
+    pool().stop();
+}
+
+void runParallel(unsigned count, const std::function<void(unsigned)>& body) {
+    if (count == 0) return;
+
+    auto job = std::make_shared<ParallelJob>(count, body);
+    for (unsigned i = 1; i < count; ++i) {
+        pool().post([job]() { job->runSlots(); });
+    }
+    job->runSlots();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&]() { return job->done == job->count; });
+    if (job->error) std::rethrow_exception(job->error);
+}
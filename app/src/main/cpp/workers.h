@@ -0,0 +1,26 @@
+// workers.h
+#pragma once
+#include <functional>
+
+// Called on each pool thread right after it starts / right before it exits.
+// The JNI layer uses them to keep the threads attached to the JVM.
+struct WorkerThreadHooks {
+    std::function<void()> onStart;
+    std::function<void()> onStop;
+};
+
+// Sets up the process-wide worker pool (one thread per core, at least two) with
+// these hooks; call it from JNI_OnLoad, before any work is posted. The threads
+// themselves start with the first runParallel() and then stay for good. The
+// library is loaded on the app's main thread during cold start, and starting and
+// JVM-attaching a thread per core there would slow every launch, even the ones
+// that never compress or extract.
+void setWorkerThreadHooks(const WorkerThreadHooks& hooks);
+
+// Joins the pool threads, if the pool ever started (JNI_OnUnload).
+void stopWorkerPool();
+
+// Runs body(0) .. body(count - 1) concurrently and waits for all of them.
+// Slots nobody has picked up yet run on the calling thread, so a busy pool
+// only costs parallelism, never progress. Rethrows the first exception.
+void runParallel(unsigned count, const std::function<void(unsigned)>& body);
@@ -0,0 +1,41 @@
+package com.deepion.kittypress
+
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+data class ArchiveEntryInfo(
+    val path: String,
+    val flags: Int,
+    val originalSize: Long,
+    val compressedSize: Long
+)
+
+object ArchiveListing {
+
+    /**
+     * Decodes the packed buffer returned by KittyPressNative.listNative():
+     * u32 count, then per entry u16 pathLen, path (UTF-8), u8 flags,
+     * u64 origSize, u64 dataSize (all little-endian).
+     */
+    fun parse(packed: ByteArray): List<ArchiveEntryInfo> {
+        val buf = ByteBuffer.wrap(packed).order(ByteOrder.LITTLE_ENDIAN)
+        val count = buf.int
+        val entries = ArrayList<ArchiveEntryInfo>(count)
+        repeat(count) {
+            val pathLen = buf.short.toInt() and 0xFFFF
+            val path = String(packed, buf.position(), pathLen, Charsets.UTF_8)
+            buf.position(buf.position() + pathLen)
+            val flags = buf.get().toInt() and 0xFF
+            val origSize = buf.long
+            val dataSize = buf.long
+            entries.add(ArchiveEntryInfo(path, flags, origSize, dataSize))
+        }
+        return entries
+    }
+
+    /** Convenience: list an archive on disk, or null if it cannot be read. */
+    fun list(archivePath: String): List<ArchiveEntryInfo>? {
+        val packed = KittyPressNative.listNative(archivePath) ?: return null
+        return parse(packed)
+    }
+}
@@ -0,0 +1,20 @@
+// CompressionOptions.kt
+package com.deepion.kittypress
+
+// Settings for KittyPressNative.compressNative(). The native side reads these
+// fields by name (toCompressOptions() in native-lib.cpp), keep them in sync.
+data class CompressionOptions(
+    val preset: Int = PRESET_BALANCED,
+    val timeBudgetSeconds: Int = 0,   // PRESET_TIME_BUDGET
+    val targetRatio: Float = 0f,      // PRESET_TARGET_RATIO: original size / archive size
+    val largeInput: Boolean = false,  // long-distance matching for backups / disk images
+    val adaptiveLevel: Boolean = false // follow CPU vs storage speed while compressing
+) {
+    companion object {
+        const val PRESET_FASTEST = 0
+        const val PRESET_BALANCED = 1
+        const val PRESET_SMALLEST = 2
+        const val PRESET_TIME_BUDGET = 3
+        const val PRESET_TARGET_RATIO = 4
+    }
+}
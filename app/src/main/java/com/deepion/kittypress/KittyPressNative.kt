@@ -1,17 +1,154 @@
 // KittyPressNative.kt (UNIFIED - Archive format for all cases)
 package com.deepion.kittypress
 
+import java.nio.ByteBuffer
+
 object KittyPressNative {
     init {
         System.loadLibrary("kittypress")
     }
 
     // Archive compression: handles 1 file, multiple files, or folders
-    // returns 0 on success, non-zero on error
-    external fun compressNative(inputArray: Array<String>, outPath: String): Int
+    // returns 0 on success, 2 if cancelled, other non-zero on error.
+    // See CompressionOptions for presets; large input mode needs more memory to
+    // compress and extract, adaptive level makes archives not byte-for-byte reproducible.
+    // cancelToken (here and below): CancelToken.id of this call, 0 = not cancellable
+    external fun compressNative(
+        inputArray: Array<String>,
+        outPath: String,
+        options: CompressionOptions,
+        cancelToken: Long
+    ): Int
+
+    // Opens inputs for compressTreeNative/resumeNative: returns a detached fd
+    // (ParcelFileDescriptor.detachFd(), native code closes it) for the document [uri], or -1.
+    // The fd must be a regular file; spool pipes and sockets into one first
+    fun interface InputSource {
+        fun openInput(uri: String): Int
+    }
+
+    // Archive compression reading documents directly (SAF, no copy into cacheDir).
+    // packed = SafTree.pack(entries) in archive order; source.openInput(uri) is called
+    // once per entry, on the calling thread. Same return codes as compressNative; the
+    // checkpoint keeps the document URIs, resumeNative reopens them through its source
+    external fun compressTreeNative(
+        packed: ByteArray,
+        source: InputSource,
+        outPath: String,
+        options: CompressionOptions,
+        cancelToken: Long
+    ): Int
+
+    // Single-file archive read straight from an opened document: fd from
+    // ParcelFileDescriptor.detachFd() (native code closes it), size = its statSize
+    // (must be known), name = the entry's name in the archive. Same return codes
+    // as compressNative; no checkpoint (a single entry has nothing to resume)
+    external fun compressFdNative(
+        fd: Int,
+        size: Long,
+        name: String,
+        outPath: String,
+        options: CompressionOptions,
+        cancelToken: Long
+    ): Int
+
+    // Continue an archive whose compressNative() or compressTreeNative() was killed with
+    // the process; it left a checkpoint "<outPath>.kpck". source reopens the documents of
+    // a compressTreeNative() archive. Same return codes as compressNative
+    external fun resumeNative(outPath: String, source: InputSource, cancelToken: Long): Int
+
+    // true if outPath has a checkpoint resumeNative() can use
+    external fun canResumeNative(outPath: String): Boolean
+
+    // Archive extraction: handles 1 file, multiple files, or folders.
+    // resume = true skips entries an earlier, interrupted run into the same outDir
+    // already extracted intact (size and checksum match)
+    external fun decompressNative(archive: String, outDir: String, resume: Boolean, cancelToken: Long): String?
+
+    // Outputs of decompressToTreeNative, both called on its calling thread.
+    // openOutput returns a detached fd (ParcelFileDescriptor.detachFd(), read-write if the
+    // provider allows, native code closes it) for [path], relative to the destination
+    // folder with '/' separators, or -1. discardOutput gets back, after an error or
+    // cancel, each opened output that wasn't finished; remove it if it was created for it
+    interface OutputSink {
+        fun openOutput(path: String): Int
+        fun discardOutput(path: String)
+    }
+
+    // Archive extraction writing straight into the documents sink.openOutput() returns
+    // (SAF destination, no staging copy in cacheDir). Same result as decompressNative.
+    // Outputs finished before an error or cancel are kept, the unfinished ones go to
+    // sink.discardOutput(); resume = true skips the intact ones on the next attempt
+    external fun decompressToTreeNative(
+        archive: String,
+        sink: OutputSink,
+        resume: Boolean,
+        cancelToken: Long
+    ): String?
+
+    // Archive listing: reads entry headers only (no decompression).
+    // Returns a packed buffer, decode it with ArchiveListing.parse(); null on error
+    external fun listNative(archive: String): ByteArray?
+
+    // Integrity check: decodes all entries in parallel without writing output.
+    // Returns the number of corrupt entries (0 = archive OK), -1 on error
+    external fun verifyNative(archive: String, cancelToken: Long): Int
+
+    // Preview: decodes entry [index] (order of listNative) into a direct ByteBuffer,
+    // skipping the first [offset] bytes of the entry. Every call decodes from the start
+    // of the entry; stream a large one with openEntryNative instead.
+    // Returns the number of bytes written at dst[0..], -1 on error
+    external fun readEntryNative(archive: String, index: Int, offset: Long, dst: ByteBuffer): Long
+
+    // Streaming preview through a bounded buffer: opens entry [index] at [offset] and
+    // returns a reader handle (0 on error). readEntryStreamNative fills dst[0..] with the
+    // next bytes and returns how many (0 at the end, -1 on error); each call continues
+    // where the last one stopped, so the entry is decoded once. Always closeEntryNative
+    // the handle; one thread at a time per handle
+    external fun openEntryNative(archive: String, index: Int, offset: Long): Long
+    external fun readEntryStreamNative(reader: Long, dst: ByteBuffer): Long
+    external fun closeEntryNative(reader: Long)
+
+    // In-memory compression for app-internal data (plain zstd frame, no archive header).
+    // src/dst must be direct ByteBuffers; data is read/written from index 0.
+    // Return the number of bytes written to dst, -1 on error
+    external fun compressBufferNative(src: ByteBuffer, srcLen: Int, dst: ByteBuffer, level: Int): Int
+    external fun decompressBufferNative(src: ByteBuffer, srcLen: Int, dst: ByteBuffer): Int
+
+    // Worst-case compressed size for srcLen bytes (size dst for compressBufferNative),
+    // -1 if srcLen is negative or too large for one buffer (bound over Int.MAX_VALUE)
+    external fun compressBoundNative(srcLen: Int): Int
+
+    // Original size stored in a compressBufferNative frame, -1 if invalid
+    external fun decompressedSizeNative(src: ByteBuffer, srcLen: Int): Long
+
+    // Cancellation of one compress/decompress/verify call: create the token before the
+    // call and pass its id, cancel() from any thread (before the call starts, too; it
+    // then returns right away), close() once the call returned. A cancelled call
+    // returns early (compress: 2, decompress: null) and removes its partial output;
+    // other calls keep running
+    class CancelToken : AutoCloseable {
+        val id: Long = newCancelTokenNative()
+
+        @Volatile
+        var isCancelled = false
+            private set
+
+        fun cancel() {
+            isCancelled = true
+            cancelNative(id)
+        }
+
+        override fun close() = releaseCancelTokenNative(id)
+    }
+
+    external fun newCancelTokenNative(): Long
+    external fun cancelNative(token: Long)
+    external fun releaseCancelTokenNative(token: Long)
 
-    // Archive extraction: handles 1 file, multiple files, or folders
-    external fun decompressNative(archive: String, outDir: String): String?
+    // Memory budget in bytes for compression/extraction (0 = automatic, based on RAM).
+    // Worker counts, buffer sizes and the compression window are derived from it
+    external fun setMemoryBudgetNative(bytes: Long)
 
     // registers native -> Java progress callback endpoint
     external fun registerProgressCallback()
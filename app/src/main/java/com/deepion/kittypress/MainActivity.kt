@@ -4,25 +4,32 @@ package com.deepion.kittypress
 import android.content.Intent
 import android.net.Uri
 import android.os.Bundle
+import android.os.ParcelFileDescriptor
+import android.text.InputType
 import android.util.Log
 import android.view.Menu
 import android.view.MenuItem
 import android.view.View
 import android.widget.Button
+import android.widget.EditText
 import android.widget.ProgressBar
 import android.widget.TextView
 import androidx.activity.result.ActivityResultLauncher
 import androidx.activity.result.contract.ActivityResultContracts
+import androidx.appcompat.app.AlertDialog
 import androidx.appcompat.app.AppCompatActivity
 import androidx.appcompat.app.AppCompatDelegate
 import androidx.appcompat.widget.Toolbar
 import androidx.documentfile.provider.DocumentFile
 import androidx.lifecycle.lifecycleScope
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.NonCancellable
 import kotlinx.coroutines.withContext
 import kotlinx.coroutines.launch
 import java.io.File
 import java.io.IOException
+import java.util.concurrent.CopyOnWriteArraySet
+import java.util.concurrent.atomic.AtomicBoolean
 
 class MainActivity : AppCompatActivity() {
 
@@ -34,6 +41,7 @@ class MainActivity : AppCompatActivity() {
     private lateinit var btnPickFolder: Button
     private lateinit var btnPickArchive: Button
     private lateinit var btnExtractSelected: Button
+    private lateinit var btnCancel: Button
     private lateinit var progressBar: ProgressBar
     private lateinit var tvProgressPct: TextView
 
@@ -60,11 +68,31 @@ class MainActivity : AppCompatActivity() {
 
         const val PREFS_NAME = "kittypress_prefs"
         const val PREF_KEY_THEME = "theme_mode"
+        const val PREF_KEY_LARGE_INPUT = "large_input_mode"
+        const val PREF_KEY_ADAPTIVE_LEVEL = "adaptive_level"
+        const val PREF_KEY_PRESET = "compression_preset"
+        const val PREF_KEY_TIME_BUDGET = "time_budget_seconds"
+        const val PREF_KEY_TARGET_RATIO = "target_ratio"
+
+        // Process-wide, unlike isCompressing: a compression outlives the activity that
+        // started it (rotation, theme switch), and its checkpoint and input copies in
+        // cacheDir must not be resumed or discarded by the recreated one meanwhile
+        private val compressionRunning = AtomicBoolean(false)
+
+        // Cancel tokens of the native calls in flight, for the same reason process-wide:
+        // the Cancel button of a recreated activity must still reach them
+        private val runningJobs = CopyOnWriteArraySet<KittyPressNative.CancelToken>()
     }
 
     private val pickFilesLauncher: ActivityResultLauncher<Array<String>> =
         registerForActivityResult(ActivityResultContracts.OpenMultipleDocuments()) { uris ->
             if (!uris.isNullOrEmpty()) {
+                // a resumed compression reads them again from a later process
+                for (uri in uris) {
+                    try {
+                        contentResolver.takePersistableUriPermission(uri, Intent.FLAG_GRANT_READ_URI_PERMISSION)
+                    } catch (_: Exception) {}
+                }
                 selectedFileUris.clear()
                 selectedFileUris.addAll(uris)
                 selectedInputsOrdered.removeAll { it in selectedFileUris }
@@ -187,6 +215,7 @@ class MainActivity : AppCompatActivity() {
         btnPickFolder = findViewById(R.id.btn_pick_folder)
         btnPickArchive = findViewById(R.id.btn_pick_archive)
         btnExtractSelected = findViewById(R.id.btn_extract_selected)
+        btnCancel = findViewById(R.id.btn_cancel)
 
         progressBar = findViewById(R.id.progress_bar)
         tvProgressPct = findViewById(R.id.tv_progress_pct)
@@ -207,6 +236,16 @@ class MainActivity : AppCompatActivity() {
             }
         } catch (_: Exception) {}
 
+        // only on a cold start: a recreated activity may sit next to a running job
+        if (savedInstanceState == null) offerResumeIfAny()
+
+        if (runningJobs.isNotEmpty()) btnCancel.visibility = View.VISIBLE
+        btnCancel.setOnClickListener {
+            if (runningJobs.isEmpty()) return@setOnClickListener
+            runningJobs.forEach { it.cancel() }
+            statusTv.text = "⏹️ Cancelling..."
+        }
+
         btnPickFiles.setOnClickListener { pickFilesLauncher.launch(arrayOf("*/*")) }
         btnPickFolder.setOnClickListener { pickInputFolderLauncher.launch(null) }
 
@@ -255,13 +294,141 @@ class MainActivity : AppCompatActivity() {
         }
     }
 
+    // A compression killed with the process leaves its temp archive, a checkpoint
+    // "<archive>.kpck" and the input copies in cacheDir; offer to finish it.
+    private fun offerResumeIfAny() {
+        if (compressionRunning.get()) return
+        val checkpoint = cacheDir.listFiles { f -> f.name.endsWith(".kitty.kpck") }
+            ?.maxByOrNull { it.lastModified() } ?: return
+        val archive = File(checkpoint.path.removeSuffix(".kpck"))
+
+        if (!KittyPressNative.canResumeNative(archive.absolutePath)) {
+            checkpoint.delete()
+            archive.delete()
+            deleteInputCopies()
+            return
+        }
+
+        AlertDialog.Builder(this)
+            .setTitle("Unfinished archive")
+            .setMessage("Compressing ${archive.name} was interrupted. Continue where it stopped?")
+            .setPositiveButton("Resume") { _, _ -> lifecycleScope.launch { resumeCompression(archive) } }
+            .setNegativeButton("Discard") { _, _ ->
+                if (compressionRunning.get()) return@setNegativeButton
+                checkpoint.delete()
+                archive.delete()
+                deleteInputCopies()
+            }
+            .show()
+    }
+
+    private suspend fun resumeCompression(archive: File) {
+        withContext(Dispatchers.IO) {
+            if (!compressionRunning.compareAndSet(false, true)) return@withContext
+            isCompressing = true
+            withContext(Dispatchers.Main) {
+                btnCompress.isEnabled = false
+                statusTv.text = "⏯️ Resuming ${archive.name}..."
+            }
+
+            try {
+                val rc = cancellable { token ->
+                    KittyPressNative.resumeNative(archive.absolutePath, documentSource, token)
+                }
+                deleteInputCopies()
+
+                if (rc != 0) {
+                    archive.delete()
+                    withContext(Dispatchers.Main) {
+                        sessionResetUI()
+                        statusTv.text = compressionFailedText(rc)
+                    }
+                    return@withContext
+                }
+
+                pendingArchiveToCopy = archive
+                pendingArchiveName = archive.name
+                withContext(Dispatchers.Main) {
+                    statusTv.text = "📁 Choose destination folder to save archive"
+                    pickDestinationFolderLauncher.launch(null)
+                }
+            } finally {
+                isCompressing = false
+                compressionRunning.set(false)
+                withContext(Dispatchers.Main) { btnCompress.isEnabled = true }
+            }
+        }
+    }
+
+    // Reads compressTreeNative/resumeNative inputs: document URIs, or file:// URIs
+    // of copies in cacheDir (withKnownSizes). The engine only reads regular files;
+    // a provider that hands out a pipe or socket (statSize -1, cloud documents) gets
+    // its stream spooled into cacheDir and the engine reads the spool file
+    private val documentSource = KittyPressNative.InputSource { uri ->
+        try {
+            val pfd = contentResolver.openFileDescriptor(Uri.parse(uri), "r")
+                ?: return@InputSource -1
+            if (pfd.statSize >= 0) pfd.detachFd() else spool(pfd)
+        } catch (e: Exception) {
+            Log.e(TAG, "openInput $uri", e)
+            -1
+        }
+    }
+
+    // Copies a non-seekable input (closing it) into an unlinked file in cacheDir and
+    // returns a detached fd of that; the space is freed when the engine closes the fd
+    private fun spool(pfd: ParcelFileDescriptor): Int {
+        val file = File(cacheDir, "input_spool_${System.nanoTime()}")
+        try {
+            ParcelFileDescriptor.AutoCloseInputStream(pfd).use { input ->
+                file.outputStream().use { fos -> input.copyTo(fos) }
+            }
+            return ParcelFileDescriptor
+                .open(file, ParcelFileDescriptor.MODE_READ_ONLY)
+                .detachFd()
+        } finally {
+            file.delete()
+        }
+    }
+
+    // Runs a native call with a fresh cancel token (its id is passed to [block]) that the
+    // Cancel button and onDestroy can reach while the call runs
+    private suspend fun <T> cancellable(block: (Long) -> T): T {
+        val token = KittyPressNative.CancelToken()
+        runningJobs += token
+        withContext(Dispatchers.Main) { btnCancel.visibility = View.VISIBLE }
+        try {
+            return block(token.id)
+        } finally {
+            runningJobs -= token
+            token.close()
+            if (runningJobs.isEmpty()) {
+                withContext(NonCancellable + Dispatchers.Main) { btnCancel.visibility = View.GONE }
+            }
+        }
+    }
+
+    private fun compressionFailedText(rc: Int) =
+        if (rc == 2) "⏹️ Compression cancelled." else "❌ Compression failed."
+
+    // Temp copies made by compressActionSingleFile / compressActionMultiFile
+    private fun deleteInputCopies() {
+        cacheDir.listFiles { f -> f.name.startsWith("input_") || f.name.startsWith("inputs_") }
+            ?.forEach { it.deleteRecursively() }
+    }
+
     private fun detectSingleFileMode(): Boolean {
         return selectedFileUris.size == 1 && selectedFolderUris.isEmpty()
     }
 
     private suspend fun compressAction() {
         withContext(Dispatchers.IO) {
-            if (isCompressing) return@withContext
+            if (!compressionRunning.compareAndSet(false, true)) {
+                withContext(Dispatchers.Main) {
+                    statusTv.text = "⏳ Compression already in progress..."
+                }
+                return@withContext
+            }
             isCompressing = true
             withContext(Dispatchers.Main) { btnCompress.isEnabled = false }
 
@@ -307,6 +474,7 @@ class MainActivity : AppCompatActivity() {
                 }
             } finally {
                 isCompressing = false
+                compressionRunning.set(false)
                 withContext(Dispatchers.Main) { btnCompress.isEnabled = true }
             }
         }
@@ -327,33 +495,34 @@ class MainActivity : AppCompatActivity() {
                 tmpArchive.parentFile?.mkdirs()
 
                 withContext(Dispatchers.Main) {
-                    statusTv.text = "📥 Reading selected file..."
+                    statusTv.text = "⚙️ Running compression engine..."
                 }
 
-                // Copy input URI to temp file
-                val tmpInput = File(cacheDir, "input_${System.currentTimeMillis()}_$inputName")
-                contentResolver.openInputStream(inputUri)?.use { inputStream ->
-                    tmpInput.outputStream().use { fos ->
-                        inputStream.copyTo(fos)
+                // The engine reads the document through its fd, nothing is copied into
+                // cacheDir. Providers that can't report a size (pipes) still get a copy
+                val pfd = contentResolver.openFileDescriptor(inputUri, "r")
+                    ?: throw IOException("Cannot open input URI")
+                val rc = if (pfd.statSize >= 0) {
+                    val size = pfd.statSize
+                    cancellable { token ->
+                        KittyPressNative.compressFdNative(
+                            pfd.detachFd(),  // closed by the native side
+                            size,
+                            inputName,
+                            tmpArchive.absolutePath,
+                            compressionOptions(),
+                            token
+                        )
                     }
-                } ?: throw IOException("Cannot open input URI")
-
-                withContext(Dispatchers.Main) {
-                    statusTv.text = "⚙️ Running compression engine..."
+                } else {
+                    pfd.close()
+                    compressCopyOf(inputUri, inputName, tmpArchive)
                 }
 
-                // Use the archive compression (handles single file too)
-                val rc = KittyPressNative.compressNative(
-                    arrayOf(tmpInput.absolutePath),  // Pass as array with one element
-                    tmpArchive.absolutePath
-                )
-
-                tmpInput.delete()
-
                 if (rc != 0) {
                     withContext(Dispatchers.Main) {
                         sessionResetUI()
-                        statusTv.text = "❌ Compression failed."
+                        statusTv.text = compressionFailedText(rc)
                     }
                     tmpArchive.delete()
                     return@withContext
@@ -388,19 +557,46 @@ class MainActivity : AppCompatActivity() {
         }
     }
 
+    // Fallback for compressActionSingleFile: copy the input to cacheDir, compress the copy
+    private suspend fun compressCopyOf(inputUri: Uri, inputName: String, archive: File): Int {
+        withContext(Dispatchers.Main) {
+            statusTv.text = "📥 Reading selected file..."
+        }
+
+        val tmpInput = File(cacheDir, "input_${System.currentTimeMillis()}_$inputName")
+        try {
+            contentResolver.openInputStream(inputUri)?.use { inputStream ->
+                tmpInput.outputStream().use { fos ->
+                    inputStream.copyTo(fos)
+                }
+            } ?: throw IOException("Cannot open input URI")
+
+            withContext(Dispatchers.Main) {
+                statusTv.text = "⚙️ Running compression engine..."
+            }
+            return cancellable { token ->
+                KittyPressNative.compressNative(
+                    arrayOf(tmpInput.absolutePath),
+                    archive.absolutePath,
+                    compressionOptions(),
+                    token
+                )
+            }
+        } finally {
+            tmpInput.delete()
+        }
+    }
+
     private suspend fun compressActionMultiFile() {
         withContext(Dispatchers.IO) {
             try {
-                val inputsRootTmp = File.createTempFile("inputs_", "", cacheDir)
-                val inputsRoot = inputsRootTmp.apply {
-                    delete()
-                    mkdirs()
+                withContext(Dispatchers.Main) {
+                    statusTv.text = "📂 Listing selected files..."
                 }
 
-                if (inputsRoot.exists()) inputsRoot.deleteRecursively()
-                inputsRoot.mkdirs()
-
-                val inputsToPass = mutableListOf<String>()
+                // The documents are read in place by the engine (one fd at a time);
+                // nothing is copied into cacheDir first
+                val entries = mutableListOf<SafEntry>()
 
                 for (treeUri in selectedFolderUris) {
                     val rootDoc = DocumentFile.fromTreeUri(this@MainActivity, treeUri)
@@ -413,17 +609,15 @@ class MainActivity : AppCompatActivity() {
                     }
 
                     val folderName = rootDoc.name ?: "folder"
-                    val dest = File(inputsRoot, folderName)
-                    dest.mkdirs()
-                    copyDocumentTreeWithProgress(rootDoc, dest)
-                    inputsToPass.add(dest.absolutePath)
+                    // same order as a scanned folder, so archives stay reproducible
+                    entries += SafTree.listFiles(contentResolver, treeUri, folderName)
+                        .sortedBy { it.path }
                 }
 
                 for (fileUri in selectedFileUris) {
                     val name = uriDisplayName(fileUri) ?: "file"
-                    val out = File(inputsRoot, name)
-                    copyUriToFileWithProgress(fileUri, out)
-                    inputsToPass.add(out.absolutePath)
+                    val size = DocumentFile.fromSingleUri(this@MainActivity, fileUri)?.length() ?: -1L
+                    entries += SafEntry(name, fileUri, if (size > 0) size else -1L)
                 }
 
                 val baseName = computeBaseNameForArchive(selectedInputsOrdered.firstOrNull())
@@ -436,22 +630,33 @@ class MainActivity : AppCompatActivity() {
                 // Ensure parent directory exists
                 tmpArchive.parentFile?.mkdirs()
 
-                withContext(Dispatchers.Main) {
-                    statusTv.text = "⚙️ Running compression engine..."
-                }
+                val copies = File(cacheDir, "inputs_${System.currentTimeMillis()}")
+                val rc = try {
+                    val inputs = withKnownSizes(entries, copies)
 
-                val rc = KittyPressNative.compressNative(
-                    inputsToPass.toTypedArray(),
-                    tmpArchive.absolutePath
-                )
+                    withContext(Dispatchers.Main) {
+                        statusTv.text = "⚙️ Running compression engine..."
+                    }
+
+                    cancellable { token ->
+                        KittyPressNative.compressTreeNative(
+                            SafTree.pack(inputs),
+                            documentSource,
+                            tmpArchive.absolutePath,
+                            compressionOptions(),
+                            token
+                        )
+                    }
+                } finally {
+                    copies.deleteRecursively()
+                }
 
                 if (rc != 0) {
                     withContext(Dispatchers.Main) {
                         sessionResetUI()
-                        statusTv.text = "❌ Compression failed."
+                        statusTv.text = compressionFailedText(rc)
                     }
                     tmpArchive.delete()
-                    inputsRoot.deleteRecursively()
                     return@withContext
                 }
 
@@ -474,8 +679,6 @@ class MainActivity : AppCompatActivity() {
                     }
                 }
 
-                inputsRoot.deleteRecursively()
-
             } catch (ex: Exception) {
                 Log.e(TAG, "compressActionMultiFile", ex)
                 withContext(Dispatchers.Main) {
@@ -486,6 +689,28 @@ class MainActivity : AppCompatActivity() {
         }
     }
 
+    // Providers that don't report a size (or report 0) are asked for it. Documents
+    // that still have none (pipes) are copied into [copies] and read from the copy,
+    // whose size is what was actually read
+    private suspend fun withKnownSizes(entries: List<SafEntry>, copies: File): List<SafEntry> {
+        if (entries.none { it.size < 0 }) return entries
+        withContext(Dispatchers.Main) {
+            statusTv.text = "📥 Reading selected files..."
+        }
+        return entries.mapIndexed { i, e ->
+            if (e.size >= 0) return@mapIndexed e
+            val size = contentResolver.openFileDescriptor(e.uri, "r")?.use { it.statSize } ?: -1L
+            if (size >= 0) return@mapIndexed e.copy(size = size)
+
+            copies.mkdirs()
+            val copy = File(copies, i.toString())
+            contentResolver.openInputStream(e.uri)?.use { inputStream ->
+                copy.outputStream().use { fos -> inputStream.copyTo(fos) }
+            } ?: throw IOException("Cannot open ${e.path}")
+            e.copy(uri = Uri.fromFile(copy), size = copy.length())
+        }
+    }
+
     private suspend fun runExtractToFolderInternal(archiveUri: Uri, treeUri: Uri) {
         if (isExtracting) throw IllegalStateException("Already extracting")
         isExtracting = true
@@ -495,36 +720,36 @@ class MainActivity : AppCompatActivity() {
             }
 
             val name = uriDisplayName(archiveUri) ?: "archive.kitty"
-            val tmpArchive = File(cacheDir, "in_${System.currentTimeMillis()}_$name")
-            if (tmpArchive.exists()) tmpArchive.delete()
-
-            // Copy archive to temp file
-            contentResolver.openInputStream(archiveUri)?.use { input ->
-                tmpArchive.outputStream().use { output ->
-                    val buf = ByteArray(256 * 1024)
-                    var read: Int
-                    while (input.read(buf).also { read = it } >= 0) {
-                        output.write(buf, 0, read)
+            // Working files are named after the archive, not the time, so a run that was
+            // interrupted (process killed, cancelled, failed) leaves them for the next
+            // attempt; they are removed once the extraction completed.
+            val key = Integer.toHexString(archiveUri.toString().hashCode())
+            val tmpArchive = File(cacheDir, "in_${key}_$name")
+            // marks an extraction into the destination that hasn't finished yet
+            val unfinished = File(cacheDir, "extract_$key")
+            // staging folder of older versions, which extracted here and copied afterwards
+            File(cacheDir, "out_$key").deleteRecursively()
+
+            // Copy archive to temp file, unless the previous attempt's copy is still current
+            val source = DocumentFile.fromSingleUri(this@MainActivity, archiveUri)
+            val copyIsCurrent = tmpArchive.isFile && source != null &&
+                source.length() == tmpArchive.length() &&
+                source.lastModified() in 1..tmpArchive.lastModified()
+            if (!copyIsCurrent) {
+                tmpArchive.delete()
+                unfinished.delete()
+                contentResolver.openInputStream(archiveUri)?.use { input ->
+                    tmpArchive.outputStream().use { output ->
+                        val buf = ByteArray(256 * 1024)
+                        var read: Int
+                        while (input.read(buf).also { read = it } >= 0) {
+                            output.write(buf, 0, read)
+                        }
+                        output.flush()
                     }
-                    output.flush()
-                }
-            } ?: throw IOException("Cannot open archive")
-
-            val outDir = File(cacheDir, "out_${System.currentTimeMillis()}")
-            if (outDir.exists()) outDir.deleteRecursively()
-            outDir.mkdirs()
-
-            withContext(Dispatchers.Main) {
-                statusTv.text = "📂 Extracting files..."
+                } ?: throw IOException("Cannot open archive")
             }
 
-            // Always use archive extraction (handles 1 or multiple files)
-            val extractedRootName = KittyPressNative.decompressNative(
-                tmpArchive.absolutePath,
-                outDir.absolutePath
-            ) ?: throw IOException("Extraction failed")
-
-            val extractedRoot = File(outDir, extractedRootName)
             val baseFolderName = computeBaseNameForArchive(archiveUri)
                 ?: name.substringBeforeLast('.', name)
 
@@ -535,107 +760,33 @@ class MainActivity : AppCompatActivity() {
                 ?: destTree.createDirectory(baseFolderName)
                 ?: throw IOException("Cannot create output folder")
 
-            withContext(Dispatchers.Main) {
-                progressBar.isIndeterminate = true
-                tvProgressPct.text = "Finishing: moving files to destination..."
-                statusTv.text = "🚚 Finalizing files in destination folder..."
-            }
-
-            copyDirIntoDocumentFolder(extractedRoot, destFolder)
+            // Entries a previous attempt already wrote intact are skipped
+            val resume = unfinished.exists()
+            unfinished.createNewFile()
 
             withContext(Dispatchers.Main) {
-                progressBar.isIndeterminate = false
+                statusTv.text = if (resume) "📂 Resuming extraction..." else "📂 Extracting files..."
             }
 
+            // Decoded data goes straight into the destination documents, written once
+            var cancelled = false
+            cancellable { token ->
+                KittyPressNative.decompressToTreeNative(
+                    tmpArchive.absolutePath,
+                    SafOutputTree(contentResolver, treeUri, destFolder.uri),
+                    resume,
+                    token
+                ).also { cancelled = token.isCancelled }
+            } ?: throw IOException(if (cancelled) "cancelled" else "Extraction failed")
+
             tmpArchive.delete()
-            outDir.deleteRecursively()
+            unfinished.delete()
 
         } finally {
             isExtracting = false
         }
     }
 
-    private fun copyStreamWithProgress(ins: java.io.InputStream, out: java.io.OutputStream) {
-        val buf = ByteArray(256 * 1024)
-        var read: Int
-        try {
-            while (ins.read(buf).also { read = it } >= 0) {
-                out.write(buf, 0, read)
-            }
-            out.flush()
-        } finally {
-            try { ins.close() } catch (_: Exception) {}
-            try { out.close() } catch (_: Exception) {}
-        }
-    }
-
-    private fun copyUriToFileWithProgress(uri: Uri, out: File) {
-        contentResolver.openInputStream(uri)?.use { ins ->
-            out.outputStream().use { fos ->
-                copyStreamWithProgress(ins, fos)
-            }
-        } ?: throw IOException("Cannot open input URI")
-    }
-
-    private fun copyDocumentTreeWithProgress(doc: DocumentFile, dest: File) {
-        if (doc.isDirectory) {
-            dest.mkdirs()
-            doc.listFiles().forEach { child ->
-                val childName = child.name ?: "unknown"
-                val childDest = File(dest, childName)
-                if (child.isDirectory) {
-                    childDest.mkdirs()
-                    copyDocumentTreeWithProgress(child, childDest)
-                } else {
-                    contentResolver.openInputStream(child.uri)?.use { input ->
-                        childDest.outputStream().use { out ->
-                            copyStreamWithProgress(input, out)
-                        }
-                    }
-                }
-            }
-        } else {
-            val name = doc.name ?: "file"
-            val outFile = File(dest, name)
-            contentResolver.openInputStream(doc.uri)?.use { input ->
-                outFile.outputStream().use { out ->
-                    copyStreamWithProgress(input, out)
-                }
-            }
-        }
-    }
-
-    private fun copyDirIntoDocumentFolder(src: File, destDir: DocumentFile) {
-        if (src.isFile) {
-            val name = src.name
-            destDir.findFile(name)?.delete()
-            val created = destDir.createFile("application/octet-stream", name)
-                ?: throw IOException("Failed to create file")
-
-            contentResolver.openOutputStream(created.uri)?.use { out ->
-                copyFileFast(src, out)
-            }
-            return
-        }
-
-        src.listFiles()?.forEach { f ->
-            if (f.isDirectory) {
-                val sub = destDir.findFile(f.name) ?: destDir.createDirectory(f.name)
-                ?: throw IOException("Failed to create dir ${f.name}")
-                copyDirIntoDocumentFolder(f, sub)
-            } else {
-                val file = destDir.findFile(f.name) ?: destDir.createFile(
-                    "application/octet-stream",
-                    f.name
-                ) ?: throw IOException("Failed to create file ${f.name}")
-
-                contentResolver.openOutputStream(file.uri)?.use { out ->
-                    copyFileFast(f, out)
-                }
-            }
-        }
-    }
-
     private fun uriDisplayName(uri: Uri): String? {
         try {
             val doc = DocumentFile.fromSingleUri(this, uri)
@@ -715,6 +866,7 @@ class MainActivity : AppCompatActivity() {
 
         progressBar.visibility = View.GONE
         tvProgressPct.visibility = View.GONE
+        btnCancel.visibility = View.GONE
         progressBar.progress = 0
         tvProgressPct.text = ""
 
@@ -723,9 +875,17 @@ class MainActivity : AppCompatActivity() {
         btnCompress.isEnabled = true
     }
 
+    override fun onDestroy() {
+        // Leaving for good: stop the native job instead of letting it burn CPU in the background
+        if (isFinishing) runningJobs.forEach { it.cancel() }
+        super.onDestroy()
+    }
+
     override fun onCreateOptionsMenu(menu: Menu?): Boolean {
         menuInflater.inflate(R.menu.menu_main, menu)
         updateDarkModeMenuTitle(menu)
+        menu?.findItem(R.id.menu_large_input)?.isChecked = isLargeInputMode()
+        menu?.findItem(R.id.menu_adaptive_level)?.isChecked = isAdaptiveLevel()
         return true
     }
 
@@ -737,6 +897,34 @@ class MainActivity : AppCompatActivity() {
                 invalidateOptionsMenu()
                 true
             }
+            R.id.menu_preset -> {
+                showPresetDialog()
+                true
+            }
+            R.id.menu_large_input -> {
+                val enabled = !item.isChecked
+                item.isChecked = enabled
+                getSharedPreferences(PREFS_NAME, MODE_PRIVATE)
+                    .edit().putBoolean(PREF_KEY_LARGE_INPUT, enabled).apply()
+                statusTv.text = if (enabled) {
+                    "🐘 Large input mode on (better for backups and disk images, uses more memory)"
+                } else {
+                    "Large input mode off"
+                }
+                true
+            }
+            R.id.menu_adaptive_level -> {
+                val enabled = !item.isChecked
+                item.isChecked = enabled
+                getSharedPreferences(PREFS_NAME, MODE_PRIVATE)
+                    .edit().putBoolean(PREF_KEY_ADAPTIVE_LEVEL, enabled).apply()
+                statusTv.text = if (enabled) {
+                    "⚡ Adaptive level on (adjusts to your storage and CPU speed)"
+                } else {
+                    "Adaptive level off"
+                }
+                true
+            }
             R.id.menu_exit -> {
                 exitApp()
                 true
@@ -776,6 +964,78 @@ class MainActivity : AppCompatActivity() {
         statusTv.text = "🎨 Switched to $modeStr mode"
     }
 
+    private fun compressionOptions(): CompressionOptions {
+        val prefs = getSharedPreferences(PREFS_NAME, MODE_PRIVATE)
+        return CompressionOptions(
+            preset = prefs.getInt(PREF_KEY_PRESET, CompressionOptions.PRESET_BALANCED),
+            timeBudgetSeconds = prefs.getInt(PREF_KEY_TIME_BUDGET, 60),
+            targetRatio = prefs.getFloat(PREF_KEY_TARGET_RATIO, 2f),
+            largeInput = isLargeInputMode(),
+            adaptiveLevel = isAdaptiveLevel()
+        )
+    }
+
+    private fun showPresetDialog() {
+        val prefs = getSharedPreferences(PREFS_NAME, MODE_PRIVATE)
+        val names = arrayOf("Fastest", "Balanced", "Smallest", "Finish within…", "Target ratio…")
+        val current = prefs.getInt(PREF_KEY_PRESET, CompressionOptions.PRESET_BALANCED)
+
+        AlertDialog.Builder(this)
+            .setTitle("Compression preset")
+            .setSingleChoiceItems(names, current) { dialog, which ->
+                dialog.dismiss()
+                when (which) {
+                    CompressionOptions.PRESET_TIME_BUDGET -> askPresetValue(
+                        which, "Finish within (seconds)", PREF_KEY_TIME_BUDGET,
+                        prefs.getInt(PREF_KEY_TIME_BUDGET, 60).toString()
+                    )
+                    CompressionOptions.PRESET_TARGET_RATIO -> askPresetValue(
+                        which, "Target ratio (e.g. 2 = half size)", PREF_KEY_TARGET_RATIO,
+                        prefs.getFloat(PREF_KEY_TARGET_RATIO, 2f).toString()
+                    )
+                    else -> {
+                        prefs.edit().putInt(PREF_KEY_PRESET, which).apply()
+                        statusTv.text = "🎛️ Preset: ${names[which]}"
+                    }
+                }
+            }
+            .setNegativeButton("Cancel", null)
+            .show()
+    }
+
+    private fun askPresetValue(preset: Int, title: String, key: String, initial: String) {
+        val input = EditText(this).apply {
+            inputType = InputType.TYPE_CLASS_NUMBER or InputType.TYPE_NUMBER_FLAG_DECIMAL
+            setText(initial)
+        }
+        AlertDialog.Builder(this)
+            .setTitle(title)
+            .setView(input)
+            .setPositiveButton("OK") { _, _ ->
+                val value = input.text.toString().toFloatOrNull()
+                if (value == null || value <= 0f) {
+                    statusTv.text = "⚠️ Invalid value, preset unchanged."
+                    return@setPositiveButton
+                }
+                val editor = getSharedPreferences(PREFS_NAME, MODE_PRIVATE).edit()
+                if (key == PREF_KEY_TIME_BUDGET) {
+                    editor.putInt(key, value.toInt().coerceAtLeast(1))
+                } else {
+                    editor.putFloat(key, value)
+                }
+                editor.putInt(PREF_KEY_PRESET, preset).apply()
+                statusTv.text = "🎛️ Preset: $title = $value"
+            }
+            .setNegativeButton("Cancel", null)
+            .show()
+    }
+
+    private fun isLargeInputMode(): Boolean =
+        getSharedPreferences(PREFS_NAME, MODE_PRIVATE).getBoolean(PREF_KEY_LARGE_INPUT, false)
+
+    private fun isAdaptiveLevel(): Boolean =
+        getSharedPreferences(PREFS_NAME, MODE_PRIVATE).getBoolean(PREF_KEY_ADAPTIVE_LEVEL, false)
+
     private fun exitApp() {
         finishAffinity()
     }
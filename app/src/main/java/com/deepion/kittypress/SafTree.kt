@@ -0,0 +1,179 @@
+package com.deepion.kittypress
+
+import android.content.ContentResolver
+import android.net.Uri
+import android.provider.DocumentsContract
+import android.util.Log
+import java.io.IOException
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+data class SafEntry(
+    val path: String,   // path inside the archive
+    val uri: Uri,       // document to read
+    val size: Long      // -1 if the provider doesn't report it
+)
+
+object SafTree {
+
+    private val PROJECTION = arrayOf(
+        DocumentsContract.Document.COLUMN_DOCUMENT_ID,
+        DocumentsContract.Document.COLUMN_DISPLAY_NAME,
+        DocumentsContract.Document.COLUMN_MIME_TYPE,
+        DocumentsContract.Document.COLUMN_SIZE
+    )
+
+    /**
+     * Lists every file below [treeUri] as "[rootName]/sub/dir/file". Each directory
+     * costs one query that returns id, name, type and size of all its children,
+     * unlike DocumentFile.listFiles() + isDirectory/name/length, which go back to
+     * the provider for every attribute of every child.
+     */
+    fun listFiles(resolver: ContentResolver, treeUri: Uri, rootName: String): List<SafEntry> {
+        val files = ArrayList<SafEntry>()
+        val pending = ArrayDeque<Pair<String, String>>() // document id, path
+        pending.add(DocumentsContract.getTreeDocumentId(treeUri) to rootName)
+
+        while (pending.isNotEmpty()) {
+            val (dirId, dirPath) = pending.removeLast()
+            val children = DocumentsContract.buildChildDocumentsUriUsingTree(treeUri, dirId)
+            resolver.query(children, PROJECTION, null, null, null)?.use { c ->
+                while (c.moveToNext()) {
+                    val id = c.getString(0) ?: continue
+                    val path = "$dirPath/${c.getString(1) ?: "unknown"}"
+                    if (c.getString(2) == DocumentsContract.Document.MIME_TYPE_DIR) {
+                        pending.add(id to path)
+                    } else {
+                        val size = if (c.isNull(3)) -1L else c.getLong(3)
+                        files.add(SafEntry(path, DocumentsContract.buildDocumentUriUsingTree(treeUri, id), size))
+                    }
+                }
+            }
+        }
+        return files
+    }
+
+    /**
+     * Packs entries for KittyPressNative.compressTreeNative(): u32 count, then per
+     * entry u16 pathLen, path (UTF-8), u64 size, u16 uriLen, uri (UTF-8; all
+     * little-endian). Sizes must be known; documents without one have to be copied
+     * to a file first.
+     */
+    fun pack(entries: List<SafEntry>): ByteArray {
+        entries.firstOrNull { it.size < 0 }?.let {
+            throw IllegalArgumentException("Unknown size: ${it.path}")
+        }
+        val paths = entries.map { it.path.toByteArray(Charsets.UTF_8) }
+        val uris = entries.map { it.uri.toString().toByteArray(Charsets.UTF_8) }
+        val buf = ByteBuffer.allocate(4 + entries.indices.sumOf { 2 + paths[it].size + 8 + 2 + uris[it].size })
+            .order(ByteOrder.LITTLE_ENDIAN)
+        buf.putInt(entries.size)
+        entries.forEachIndexed { i, e ->
+            buf.putShort(paths[i].size.toShort())
+            buf.put(paths[i])
+            buf.putLong(e.size)
+            buf.putShort(uris[i].size.toShort())
+            buf.put(uris[i])
+        }
+        return buf.array()
+    }
+}
+
+/**
+ * Creates extraction outputs below the document [root] of [treeUri] for
+ * KittyPressNative.decompressToTreeNative(). Each directory is listed once (one
+ * query) the first time an output lands in it; existing files are reused, so a
+ * resumed extraction can check and skip them, and missing ones are created.
+ * Discarded outputs are deleted if they were created here, existing ones stay.
+ */
+class SafOutputTree(
+    private val resolver: ContentResolver,
+    private val treeUri: Uri,
+    root: Uri
+) : KittyPressNative.OutputSink {
+
+    private val dirs = HashMap<String, Uri>()                      // path -> directory
+    private val children = HashMap<Uri, HashMap<String, Uri>>()    // directory -> name -> document
+    private val created = HashMap<String, Uri>()                   // output path -> new document
+
+    init {
+        dirs[""] = root
+    }
+
+    override fun openOutput(path: String): Int {
+        return try {
+            val slash = path.lastIndexOf('/')
+            val dir = directory(if (slash < 0) "" else path.substring(0, slash))
+            val name = path.substring(slash + 1)
+            val doc = childrenOf(dir)[name]
+                ?: create(dir, "application/octet-stream", name).also { created[path] = it }
+            // "rw" lets a resumed run read what is there; not every provider offers it
+            val pfd = try {
+                resolver.openFileDescriptor(doc, "rw")
+            } catch (e: Exception) {
+                null
+            } ?: resolver.openFileDescriptor(doc, "w")
+            pfd?.detachFd() ?: -1
+        } catch (e: Exception) {
+            Log.e("SafOutputTree", "openOutput $path", e)
+            -1
+        }
+    }
+
+    override fun discardOutput(path: String) {
+        val doc = created.remove(path) ?: return
+        try {
+            DocumentsContract.deleteDocument(resolver, doc)
+            // a retry in this tree has to create it again
+            val slash = path.lastIndexOf('/')
+            val dir = dirs[if (slash < 0) "" else path.substring(0, slash)]
+            dir?.let { children[it] }?.remove(path.substring(slash + 1))
+        } catch (e: Exception) {
+            Log.e("SafOutputTree", "discardOutput $path", e)
+        }
+    }
+
+    private fun directory(path: String): Uri {
+        dirs[path]?.let { return it }
+        val slash = path.lastIndexOf('/')
+        val parent = directory(if (slash < 0) "" else path.substring(0, slash))
+        val name = path.substring(slash + 1)
+        val dir = childrenOf(parent)[name]
+            ?: create(parent, DocumentsContract.Document.MIME_TYPE_DIR, name)
+        dirs[path] = dir
+        return dir
+    }
+
+    private fun childrenOf(dir: Uri): HashMap<String, Uri> {
+        return children.getOrPut(dir) {
+            val names = HashMap<String, Uri>()
+            val query = DocumentsContract.buildChildDocumentsUriUsingTree(
+                treeUri, DocumentsContract.getDocumentId(dir)
+            )
+            resolver.query(query, CHILD_PROJECTION, null, null, null)?.use { c ->
+                while (c.moveToNext()) {
+                    val id = c.getString(0) ?: continue
+                    val name = c.getString(1) ?: continue
+                    names[name] = DocumentsContract.buildDocumentUriUsingTree(treeUri, id)
+                }
+            }
+            names
+        }
+    }
+
+    private fun create(dir: Uri, mime: String, name: String): Uri {
+        val doc = DocumentsContract.createDocument(resolver, dir, mime, name)
+            ?: throw IOException("Cannot create $name")
+        childrenOf(dir)[name] = doc
+        // a directory made here starts out empty, no need to list it
+        if (mime == DocumentsContract.Document.MIME_TYPE_DIR) children[doc] = HashMap()
+        return doc
+    }
+
+    private companion object {
+        val CHILD_PROJECTION = arrayOf(
+            DocumentsContract.Document.COLUMN_DOCUMENT_ID,
+            DocumentsContract.Document.COLUMN_DISPLAY_NAME
+        )
+    }
+}